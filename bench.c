@@ -0,0 +1,329 @@
+/*
+ * file:        bench.c
+ * description: in-process benchmarks - call fs_ops directly, as the
+ *              misc.c REPL does, so the numbers are the file system's
+ *              own costs without FUSE and kernel round trips.
+ *
+ *  usage: bench [-n #] [-delalloc] [-lfs] [-commit ms] [-ramdisk] [-sim model]
+ *               [-o file.json] image.img
+ *     -n #       operations per workload (default 20000)
+ *     -ramdisk   run on a copy of the image in memory (see ramdisk.h)
+ *     -sim       charge the I/O to a simulated disk (see simdisk.h) and
+ *                report each workload's modeled I/O time, as sim_secs
+ *     -o         write the results there instead of to stdout
+ *
+ * The image should be freshly made (e.g. 'mkfs-x6 -size 64m'), with
+ * room for a FILE_MB file. Workloads, each in its own directory:
+ *   lookup_depth_N    getattr of a file N directories deep
+ *   getattr_storm     getattr round a full directory of files
+ *   create_unlink     mknod + unlink of a file (2 ops each)
+ *   seq_write_N       write FILE_MB in N-byte calls (then seq_read_N)
+ *   rand_read_4k      4KB reads at random 4KB offsets in that file
+ *   rand_write_4k     ditto, writes
+ *   readdir_full      readdir of a full directory (32 entries - the
+ *                     most one directory block holds)
+ * Each reports ops/s, MB/s where it applies, and p50/p99 latency. The
+ * write workloads end with a flush, which counts in the elapsed time
+ * but isn't an op, and stays out of the latencies.
+ */
+#define FUSE_USE_VERSION 27
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fuse.h>
+
+#include "blkdev.h"
+#include "iostat.h"
+#include "ramdisk.h"
+#include "simdisk.h"
+
+/* the globals misc.c would otherwise provide */
+struct blkdev *disk;
+int homework_part;
+int delalloc;
+int commit_ms = 1000;
+int lfs;
+int discard = 1;
+FILE *trace_fp;
+
+extern struct fuse_operations fs_ops;
+
+#define FILE_MB 8
+#define DIR_ENTRIES 32
+
+static FILE *out;
+static int n_results;
+static struct blkdev *sim;
+static double sim_start;
+
+static void fail(const char *what, int val)
+{
+    fprintf(stderr, "bench: %s: %s\n", what, strerror(-val));
+    exit(1);
+}
+
+/* the start of a workload's timed part */
+static uint64_t start(void)
+{
+    if (sim != NULL)
+        sim_start = simdisk_clock(sim);
+    return io_now();
+}
+
+/* one result: 'n' ops taking 'ns' in all, 'bytes' moved */
+static void report(const char *name, struct io_hist *lat, uint64_t ns, uint64_t bytes)
+{
+    double secs = ns / 1e9;
+    fprintf(out, "%s    {\"name\": \"%s\", \"ops\": %llu, \"secs\": %.6f, \"ops_per_sec\": %.1f, "
+            "\"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f",
+            n_results++ ? ",\n" : "", name, (unsigned long long)lat->n, secs, lat->n / secs,
+            bytes / 1e6 / secs, io_hist_quantile(lat, 0.5) / 1e3, io_hist_quantile(lat, 0.99) / 1e3);
+    fprintf(stderr, "%-16s %10.0f ops/s %8.2f MB/s  p50 %7.2f us  p99 %7.2f us", name,
+            lat->n / secs, bytes / 1e6 / secs, io_hist_quantile(lat, 0.5) / 1e3,
+            io_hist_quantile(lat, 0.99) / 1e3);
+    if (sim != NULL) {
+        double sim_secs = simdisk_clock(sim) - sim_start;
+        fprintf(out, ", \"sim_secs\": %.6f", sim_secs);
+        fprintf(stderr, "  sim %.3f s", sim_secs);
+    }
+    fprintf(out, "}");
+    fprintf(stderr, "\n");
+}
+
+/* time one call of an expression into 'lat' */
+#define TIMED(lat, expr) ({                     \
+    uint64_t _t = io_now();                     \
+    int _val = (expr);                          \
+    io_hist_add(lat, io_now() - _t);            \
+    _val; })
+
+static void make_dir(const char *path)
+{
+    int val = fs_ops.mkdir(path, 0777);
+    if (val < 0)
+        fail(path, val);
+}
+
+static void make_file(const char *path)
+{
+    int val = fs_ops.mknod(path, 0100666, 0);
+    if (val < 0)
+        fail(path, val);
+}
+
+static void lookup_depth(int depth, int n)
+{
+    char path[256] = "/lookup", name[64];
+    struct io_hist lat = {0};
+    struct stat sb;
+    int i;
+
+    sprintf(path + strlen(path), "%d", depth);
+    make_dir(path);
+    for (i = 1; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        make_dir(path);
+    }
+    strcat(path, "/file");
+    make_file(path);
+
+    uint64_t t0 = start();
+    for (i = 0; i < n; i++)
+        if (TIMED(&lat, fs_ops.getattr(path, &sb)) < 0)
+            fail(path, -EIO);
+    sprintf(name, "lookup_depth_%d", depth);
+    report(name, &lat, io_now() - t0, 0);
+}
+
+static void getattr_storm(int n)
+{
+    char path[DIR_ENTRIES][64];
+    struct io_hist lat = {0};
+    struct stat sb;
+    int i;
+
+    make_dir("/stat");
+    for (i = 0; i < DIR_ENTRIES; i++) {
+        sprintf(path[i], "/stat/f%d", i);
+        make_file(path[i]);
+    }
+    uint64_t t0 = start();
+    for (i = 0; i < n; i++)
+        if (TIMED(&lat, fs_ops.getattr(path[i % DIR_ENTRIES], &sb)) < 0)
+            fail(path[i % DIR_ENTRIES], -EIO);
+    report("getattr_storm", &lat, io_now() - t0, 0);
+}
+
+static void create_unlink(int n)
+{
+    struct io_hist lat = {0};
+    char path[64];
+    int i, val;
+
+    make_dir("/churn");
+    uint64_t t0 = start();
+    for (i = 0; i < n; i++) {
+        sprintf(path, "/churn/f%d", i % DIR_ENTRIES);
+        if ((val = TIMED(&lat, fs_ops.mknod(path, 0100666, 0))) < 0 ||
+            (val = TIMED(&lat, fs_ops.unlink(path))) < 0)
+            fail(path, val);
+    }
+    report("create_unlink", &lat, io_now() - t0, 0);
+}
+
+static void seq_io(int size, char *buf)
+{
+    struct io_hist lat = {0};
+    char path[64], name[64];
+    off_t off, len = FILE_MB << 20;
+    int val;
+
+    sprintf(path, "/seq/f%d", size);
+    make_file(path);
+    uint64_t t0 = start();
+    for (off = 0; off < len; off += size)
+        if ((val = TIMED(&lat, fs_ops.write(path, buf, size, off, NULL))) != size)
+            fail(path, val < 0 ? val : -ENOSPC);
+    if ((val = fs_ops.flush(path, NULL)) < 0)
+        fail(path, val);
+    sprintf(name, "seq_write_%d", size);
+    report(name, &lat, io_now() - t0, len);
+
+    memset(&lat, 0, sizeof(lat));
+    t0 = start();
+    for (off = 0; off < len; off += size)
+        if ((val = TIMED(&lat, fs_ops.read(path, buf, size, off, NULL))) != size)
+            fail(path, val < 0 ? val : -EIO);
+    sprintf(name, "seq_read_%d", size);
+    report(name, &lat, io_now() - t0, len);
+
+    if ((val = fs_ops.unlink(path)) < 0)
+        fail(path, val);
+}
+
+static void rand_io(int n, char *buf)
+{
+    struct io_hist rd = {0}, wr = {0};
+    char *path = "/rand/file";
+    off_t off, len = FILE_MB << 20;
+    int i, val;
+
+    make_dir("/rand");
+    make_file(path);
+    for (off = 0; off < len; off += 65536)
+        if ((val = fs_ops.write(path, buf, 65536, off, NULL)) != 65536)
+            fail(path, val < 0 ? val : -ENOSPC);
+    fs_ops.flush(path, NULL);
+
+    srandom(1);
+    uint64_t t0 = start();
+    for (i = 0; i < n; i++)
+        if ((val = TIMED(&rd, fs_ops.read(path, buf, 4096, random() % (len / 4096) * 4096, NULL))) != 4096)
+            fail(path, val < 0 ? val : -EIO);
+    report("rand_read_4k", &rd, io_now() - t0, (uint64_t)n * 4096);
+
+    t0 = start();
+    for (i = 0; i < n; i++)
+        if ((val = TIMED(&wr, fs_ops.write(path, buf, 4096, random() % (len / 4096) * 4096, NULL))) != 4096)
+            fail(path, val < 0 ? val : -EIO);
+    if ((val = fs_ops.flush(path, NULL)) < 0)
+        fail(path, val);
+    report("rand_write_4k", &wr, io_now() - t0, (uint64_t)n * 4096);
+}
+
+static int count_entry(void *ptr, const char *name, const struct stat *sb, off_t off)
+{
+    (*(int *)ptr)++;
+    return 0;
+}
+
+static void readdir_full(int n)
+{
+    struct io_hist lat = {0};
+    char path[64];
+    int i, entries = 0, val;
+
+    make_dir("/dir");
+    for (i = 0; i < DIR_ENTRIES; i++) {
+        sprintf(path, "/dir/f%d", i);
+        make_file(path);
+    }
+    uint64_t t0 = start();
+    for (i = 0; i < n; i++)
+        if ((val = TIMED(&lat, fs_ops.readdir("/dir", &entries, count_entry, 0, NULL))) < 0)
+            fail("/dir", val);
+    report("readdir_full", &lat, io_now() - t0, 0);
+    if (entries != n * DIR_ENTRIES)
+        fprintf(stderr, "bench: readdir found %d entries, expected %d\n", entries, n * DIR_ENTRIES);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 20000, sizes[] = {1024, 4096, 65536, 1 << 20}, i;
+    char *json = NULL;
+    char *sim_spec = NULL;
+    int ramdisk = 0;
+
+    out = stdout;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-n") && argc > 2)
+            n = atoi(argv[2]), argv++, argc--;
+        else if (!strcmp(argv[1], "-o") && argc > 2)
+            json = argv[2], argv++, argc--;
+        else if (!strcmp(argv[1], "-commit") && argc > 2)
+            commit_ms = atoi(argv[2]), argv++, argc--;
+        else if (!strcmp(argv[1], "-delalloc"))
+            delalloc = 1;
+        else if (!strcmp(argv[1], "-lfs"))
+            lfs = delalloc = 1;
+        else if (!strcmp(argv[1], "-ramdisk"))
+            ramdisk = 1;
+        else if (!strcmp(argv[1], "-sim") && argc > 2)
+            sim_spec = argv[2], argv++, argc--;
+        else
+            break;
+        argv++, argc--;
+    }
+    if (argc != 2) {
+        printf("usage: bench [-n #] [-delalloc] [-lfs] [-commit ms] [-ramdisk] [-sim model]\n"
+               "             [-o file.json] image.img\n");
+        exit(1);
+    }
+    disk = ramdisk ? ramdisk_create(argv[1], 0, NULL, 0) : image_create(argv[1]);
+    if (disk == NULL)
+        exit(1);
+    if (sim_spec != NULL && (disk = sim = simdisk_create(disk, sim_spec)) == NULL)
+        exit(1);
+    if (json != NULL && (out = fopen(json, "w")) == NULL) {
+        perror(json);
+        exit(1);
+    }
+
+    fs_ops.init(NULL);
+    fprintf(out, "{\"n\": %d, \"delalloc\": %d, \"lfs\": %d, \"commit_ms\": %d,\n"
+            " \"results\": [\n", n, delalloc, lfs, commit_ms);
+
+    lookup_depth(1, n);
+    lookup_depth(4, n);
+    lookup_depth(8, n);
+    getattr_storm(n);
+    create_unlink(n);
+
+    char *buf = malloc(1 << 20);
+    memset(buf, 'x', 1 << 20);
+    make_dir("/seq");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        seq_io(sizes[i], buf);
+    rand_io(n, buf);
+    readdir_full(n);
+
+    fprintf(out, "\n]}\n");
+    fs_ops.destroy(NULL);
+    disk->ops->close(disk);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * file:        bitmap-bench.c
+ * description: microbenchmarks for the bitmap kernels in bitmap.c, on
+ *              bitmaps of 1M to 100M bits. Each operation is timed with
+ *              every kernel set the CPU supports, and against a per-bit
+ *              loop like the FD_ISSET loops it replaces; results are
+ *              checked against the loop.
+ *
+ *  usage: bitmap-bench [bits...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+static char *kernel_names[] = {"scalar", "popcnt", "avx2"};
+#define N_NAMES (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* FD_ISSET and friends, without glibc's FD_SETSIZE check */
+#define ISSET(i, map) (((map)[(i) / 64] >> ((i) % 64)) & 1)
+#define SET(i, map) ((map)[(i) / 64] |= 1ULL << ((i) % 64))
+#define CLR(i, map) ((map)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+static uint64_t *a, *b;         /* maps under test */
+static int64_t nbits;
+static volatile int64_t sink;
+
+/* the operations - 'k' is -1 for the per-bit loop
+ */
+static int64_t op_count(int k)
+{
+    if (k >= 0)
+        return bitmap_count(a, nbits);
+    int64_t i, c = 0;
+    for (i = 0; i < nbits; i++)
+        if (ISSET(i, a))
+            c++;
+    return c;
+}
+
+static int64_t op_count_xor(int k)
+{
+    if (k >= 0)
+        return bitmap_count_xor(a, b, nbits);
+    int64_t i, c = 0;
+    for (i = 0; i < nbits; i++)
+        if (!ISSET(i, a) != !ISSET(i, b))
+            c++;
+    return c;
+}
+
+static int64_t op_find_zero(int k)
+{
+    if (k >= 0)
+        return bitmap_find_zero(b, 0, nbits);
+    int64_t i;
+    for (i = 0; i < nbits; i++)
+        if (!ISSET(i, b))
+            return i;
+    return -1;
+}
+
+static int64_t op_find_andnot(int k)
+{
+    if (k >= 0)
+        return bitmap_find_andnot(a, b, 0, nbits);
+    int64_t i;
+    for (i = 0; i < nbits; i++)
+        if (ISSET(i, a) && !ISSET(i, b))
+            return i;
+    return -1;
+}
+
+#define RUN 100
+static int64_t op_find_run(int k)
+{
+    int64_t len;
+    if (k >= 0)
+        return bitmap_find_run(b, nbits, RUN, &len);
+    int64_t i, start = 0, run = 0;
+    for (i = 0; i < nbits; i++) {
+        if (ISSET(i, b)) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0)
+            start = i;
+        if (run == RUN)
+            return start;
+    }
+    return -1;
+}
+
+struct op {
+    char *name;
+    int64_t (*fn)(int k);
+} ops[] = {
+    {"count", op_count},
+    {"count_xor", op_count_xor},
+    {"find_zero", op_find_zero},
+    {"find_andnot", op_find_andnot},
+    {"find_run", op_find_run},
+};
+#define N_OPS (sizeof(ops) / sizeof(ops[0]))
+
+/* Gbit/s for 'fn' with kernel set 'k', checking the result */
+static double bench(struct op *op, int k, int64_t expected, int *bad)
+{
+    int i, reps = 1;
+    double t;
+    for (;;) {
+        double t0 = now();
+        for (i = 0; i < reps; i++) {
+            int64_t val = op->fn(k);
+            if (val != expected)
+                *bad = 1;
+            sink = val;
+        }
+        t = now() - t0;
+        if (t > 0.1)
+            break;
+        reps *= 2;
+    }
+    return nbits * (double)reps / t / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t sizes[] = {1 << 20, 10 << 20, 100 << 20};
+    int n_sizes = 3, i, j, k, failed = 0;
+    if (argc > 1) {
+        n_sizes = argc - 1;
+        if (n_sizes > 3)
+            n_sizes = 3;
+        for (i = 0; i < n_sizes; i++)
+            if ((sizes[i] = strtoll(argv[i + 1], NULL, 0)) < 4 * RUN) {
+                printf("bitmap size must be at least %d bits\n", 4 * RUN);
+                exit(1);
+            }
+    }
+
+    printf("kernel chosen: %s\n", bitmap_kernel());
+    printf("%-10s %-12s %8s", "bits", "op", "per-bit");
+    for (k = 0; k < N_NAMES; k++)
+        printf(" %8s", kernel_names[k]);
+    printf("   (Gbit/s)\n");
+
+    for (i = 0; i < n_sizes; i++) {
+        nbits = sizes[i];
+        size_t bytes = (nbits + 63) / 64 * 8;
+        a = malloc(bytes);
+        b = malloc(bytes);
+
+        /* 'a' is random (for counting); 'b' is nearly full, like a
+         * busy block map - its only free space is a run near the end,
+         * and 'a' differs from it only there.
+         */
+        srandom(i);
+        for (j = 0; j < bytes; j++)
+            ((unsigned char *)a)[j] = random();
+        memset(b, 0xff, bytes);
+        int64_t hole = nbits - 2 * RUN;
+        for (j = 0; j < RUN; j++)
+            CLR(hole + j, b);
+        CLR(hole - 2 * RUN, b);      /* a single free bit before it */
+
+        for (j = 0; j < N_OPS; j++) {
+            int bad = 0;
+            if (ops[j].fn == op_find_andnot)
+                memcpy(a, b, bytes), SET(hole + RUN / 2, a);
+            int64_t expected = ops[j].fn(-1);
+            printf("%-10lld %-12s %8.2f", (long long)nbits, ops[j].name,
+                   bench(&ops[j], -1, expected, &bad));
+            for (k = 0; k < N_NAMES; k++) {
+                if (bitmap_use(kernel_names[k]) < 0)
+                    printf(" %8s", "-");
+                else
+                    printf(" %8.2f", bench(&ops[j], k, expected, &bad));
+            }
+            printf("%s\n", bad ? "   MISMATCH" : "");
+            failed |= bad;
+        }
+        free(a);
+        free(b);
+    }
+    return failed;
+}
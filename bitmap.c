@@ -0,0 +1,335 @@
+/*
+ * file:        bitmap.c
+ * description: bitmap operations for the block and inode maps - see
+ *              bitmap.h
+ *
+ * The work is done by kernels operating on whole 64-bit words: plain
+ * C, C compiled for POPCNT, and AVX2 (256 bits at a time). The entry
+ * points handle the partial words at either end and pick a set of
+ * kernels the first time they're called.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+struct kernels {
+    const char *name;
+    int64_t (*count)(const uint64_t *w, int64_t n);
+    int64_t (*count_xor)(const uint64_t *a, const uint64_t *b, int64_t n);
+    /* index of the first word from i on that isn't 'fill', or n */
+    int64_t (*skip)(const uint64_t *w, int64_t i, int64_t n, uint64_t fill);
+    /* index of the first word from i on with a & ~b non-zero, or n */
+    int64_t (*skip_andnot)(const uint64_t *a, const uint64_t *b, int64_t i, int64_t n);
+};
+
+/* mask of the low 'n' bits, 0 < n < 64 */
+#define LOW_BITS(n) ((1ULL << (n)) - 1)
+
+/* plain C
+ */
+static int64_t count_scalar(const uint64_t *w, int64_t n)
+{
+    int64_t i, c = 0;
+    for (i = 0; i < n; i++)
+        c += __builtin_popcountll(w[i]);
+    return c;
+}
+
+static int64_t count_xor_scalar(const uint64_t *a, const uint64_t *b, int64_t n)
+{
+    int64_t i, c = 0;
+    for (i = 0; i < n; i++)
+        c += __builtin_popcountll(a[i] ^ b[i]);
+    return c;
+}
+
+static int64_t skip_scalar(const uint64_t *w, int64_t i, int64_t n, uint64_t fill)
+{
+    while (i < n && w[i] == fill)
+        i++;
+    return i;
+}
+
+static int64_t skip_andnot_scalar(const uint64_t *a, const uint64_t *b, int64_t i, int64_t n)
+{
+    while (i < n && !(a[i] & ~b[i]))
+        i++;
+    return i;
+}
+
+#ifdef HAVE_X86
+
+/* POPCNT - the same loops, but __builtin_popcountll becomes a single
+ * instruction instead of a library call. Searching gains nothing, so
+ * it uses the plain C versions.
+ */
+__attribute__((target("popcnt")))
+static int64_t count_popcnt(const uint64_t *w, int64_t n)
+{
+    int64_t i, c = 0;
+    for (i = 0; i < n; i++)
+        c += __builtin_popcountll(w[i]);
+    return c;
+}
+
+__attribute__((target("popcnt")))
+static int64_t count_xor_popcnt(const uint64_t *a, const uint64_t *b, int64_t n)
+{
+    int64_t i, c = 0;
+    for (i = 0; i < n; i++)
+        c += __builtin_popcountll(a[i] ^ b[i]);
+    return c;
+}
+
+/* AVX2 - counting looks up each 4-bit nibble in a 16-entry table with
+ * vpshufb, adding into per-byte counters which are summed into 64-bit
+ * lanes (vpsadbw) every 31 vectors, before a byte can overflow.
+ * Searching tests 512 bits per iteration with vptest.
+ */
+__attribute__((target("avx2")))
+static inline __m256i nibble_count(__m256i v)
+{
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+}
+
+__attribute__((target("avx2")))
+static inline int64_t sum_lanes(__m256i v)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static int64_t count_avx2(const uint64_t *w, int64_t n)
+{
+    __m256i total = _mm256_setzero_si256();
+    int64_t i = 0;
+
+    while (i + 4 <= n) {
+        __m256i bytes = _mm256_setzero_si256();
+        int j;
+        for (j = 0; j < 31 && i + 4 <= n; j++, i += 4)
+            bytes = _mm256_add_epi8(bytes, nibble_count(_mm256_loadu_si256((const __m256i *)(w + i))));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    return sum_lanes(total) + count_popcnt(w + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t count_xor_avx2(const uint64_t *a, const uint64_t *b, int64_t n)
+{
+    __m256i total = _mm256_setzero_si256();
+    int64_t i = 0;
+
+    while (i + 4 <= n) {
+        __m256i bytes = _mm256_setzero_si256();
+        int j;
+        for (j = 0; j < 31 && i + 4 <= n; j++, i += 4) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i)));
+            bytes = _mm256_add_epi8(bytes, nibble_count(x));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    return sum_lanes(total) + count_xor_popcnt(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int64_t skip_avx2(const uint64_t *w, int64_t i, int64_t n, uint64_t fill)
+{
+    const __m256i f = _mm256_set1_epi64x(fill);
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i)), f);
+        __m256i y = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(w + i + 4)), f);
+        __m256i z = _mm256_or_si256(x, y);
+        if (!_mm256_testz_si256(z, z))
+            break;
+    }
+    return skip_scalar(w, i, n, fill);
+}
+
+__attribute__((target("avx2")))
+static int64_t skip_andnot_avx2(const uint64_t *a, const uint64_t *b, int64_t i, int64_t n)
+{
+    for (; i + 8 <= n; i += 8) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(a + i + 4));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + i + 4));
+        /* testc(b, a) is set when (a & ~b) == 0 */
+        if (!_mm256_testc_si256(b0, a0) || !_mm256_testc_si256(b1, a1))
+            break;
+    }
+    return skip_andnot_scalar(a, b, i, n);
+}
+
+#endif /* HAVE_X86 */
+
+static const struct kernels all_kernels[] = {
+    {"scalar", count_scalar, count_xor_scalar, skip_scalar, skip_andnot_scalar},
+#ifdef HAVE_X86
+    {"popcnt", count_popcnt, count_xor_popcnt, skip_scalar, skip_andnot_scalar},
+    {"avx2", count_avx2, count_xor_avx2, skip_avx2, skip_andnot_avx2},
+#endif
+};
+#define N_KERNELS (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const struct kernels *kernels;
+
+static int supported(const struct kernels *k)
+{
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (!strcmp(k->name, "popcnt"))
+        return __builtin_cpu_supports("popcnt");
+    if (!strcmp(k->name, "avx2"))
+        return __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/* the last supported entry in all_kernels is the fastest */
+static const struct kernels *kern(void)
+{
+    if (kernels == NULL) {
+        int i;
+        for (i = N_KERNELS - 1; i > 0 && !supported(&all_kernels[i]); i--)
+            ;
+        kernels = &all_kernels[i];
+    }
+    return kernels;
+}
+
+const char *bitmap_kernel(void)
+{
+    return kern()->name;
+}
+
+int bitmap_use(const char *name)
+{
+    int i;
+    for (i = 0; i < N_KERNELS; i++)
+        if (!strcmp(all_kernels[i].name, name) && supported(&all_kernels[i])) {
+            kernels = &all_kernels[i];
+            return 0;
+        }
+    return -1;
+}
+
+int64_t bitmap_count(const void *map, int64_t nbits)
+{
+    const uint64_t *w = map;
+    int64_t c = kern()->count(w, nbits / 64);
+    if (nbits % 64)
+        c += __builtin_popcountll(w[nbits / 64] & LOW_BITS(nbits % 64));
+    return c;
+}
+
+int64_t bitmap_count_xor(const void *a, const void *b, int64_t nbits)
+{
+    const uint64_t *wa = a, *wb = b;
+    int64_t c = kern()->count_xor(wa, wb, nbits / 64);
+    if (nbits % 64)
+        c += __builtin_popcountll((wa[nbits / 64] ^ wb[nbits / 64]) & LOW_BITS(nbits % 64));
+    return c;
+}
+
+/* first bit at or after 'start' that differs from 'fill' (0 or ~0)
+ */
+static int64_t find(const uint64_t *w, int64_t start, int64_t nbits, uint64_t fill)
+{
+    if (start < 0)
+        start = 0;
+    if (start >= nbits)
+        return -1;
+
+    int64_t i = start / 64, n = nbits / 64;
+    uint64_t x = (w[i] ^ fill) & (~0ULL << (start % 64));
+    if (!x && i < n) {
+        i = kern()->skip(w, i + 1, n, fill);
+        if (i == n && nbits % 64 == 0)
+            return -1;
+        x = w[i] ^ fill;
+    }
+    if (!x)
+        return -1;
+    int64_t bit = i * 64 + __builtin_ctzll(x);
+    return bit < nbits ? bit : -1;
+}
+
+int64_t bitmap_find_set(const void *map, int64_t start, int64_t nbits)
+{
+    return find(map, start, nbits, 0);
+}
+
+int64_t bitmap_find_zero(const void *map, int64_t start, int64_t nbits)
+{
+    return find(map, start, nbits, ~0ULL);
+}
+
+int64_t bitmap_find_andnot(const void *a, const void *b, int64_t start, int64_t nbits)
+{
+    const uint64_t *wa = a, *wb = b;
+    if (start < 0)
+        start = 0;
+    if (start >= nbits)
+        return -1;
+
+    int64_t i = start / 64, n = nbits / 64;
+    uint64_t x = wa[i] & ~wb[i] & (~0ULL << (start % 64));
+    if (!x && i < n) {
+        i = kern()->skip_andnot(wa, wb, i + 1, n);
+        if (i == n && nbits % 64 == 0)
+            return -1;
+        x = wa[i] & ~wb[i];
+    }
+    if (!x)
+        return -1;
+    int64_t bit = i * 64 + __builtin_ctzll(x);
+    return bit < nbits ? bit : -1;
+}
+
+int64_t bitmap_find_run(const void *map, int64_t nbits, int64_t n, int64_t *len)
+{
+    int64_t pos = 0, best = -1, best_len = 0;
+
+    while (best_len < n) {
+        int64_t zero = bitmap_find_zero(map, pos, nbits);
+        if (zero < 0)
+            break;
+        int64_t set = bitmap_find_set(map, zero, nbits);
+        if (set < 0)
+            set = nbits;
+        if (set - zero > best_len) {
+            best = zero;
+            best_len = set - zero;
+        }
+        pos = set;
+    }
+    *len = best_len < n ? best_len : n;
+    return best;
+}
+
+void bitmap_set_range(void *map, int64_t start, int64_t n)
+{
+    uint8_t *b = map;
+    for (; n > 0 && start % 8; start++, n--)
+        b[start / 8] |= 1 << (start % 8);
+    memset(b + start / 8, 0xff, n / 8);
+    start += n / 8 * 8;
+    for (n %= 8; n > 0; start++, n--)
+        b[start / 8] |= 1 << (start % 8);
+}
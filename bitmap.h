@@ -0,0 +1,43 @@
+/*
+ * file:        bitmap.h
+ * description: bitmap operations for the block and inode maps.
+ *
+ * Maps use the fd_set layout - bit i is bit (i % 64) of 64-bit word
+ * (i / 64) - so 'fd_set *' maps can be passed directly, and FD_SET /
+ * FD_ISSET still work on single bits. Counting and searching use
+ * POPCNT or AVX2 versions when the CPU has them, chosen at run time.
+ */
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+#include <stdint.h>
+
+/* number of set bits in the first 'nbits' bits */
+int64_t bitmap_count(const void *map, int64_t nbits);
+
+/* number of bits in which 'a' and 'b' differ */
+int64_t bitmap_count_xor(const void *a, const void *b, int64_t nbits);
+
+/* first set / clear bit at or after 'start', or -1 if none */
+int64_t bitmap_find_set(const void *map, int64_t start, int64_t nbits);
+int64_t bitmap_find_zero(const void *map, int64_t start, int64_t nbits);
+
+/* first bit at or after 'start' set in 'a' but clear in 'b', or -1 */
+int64_t bitmap_find_andnot(const void *a, const void *b, int64_t start, int64_t nbits);
+
+/* first run of 'n' clear bits, or failing that the longest run. Sets
+ * *len to the run length (at most 'n'); returns -1 if the map is full.
+ */
+int64_t bitmap_find_run(const void *map, int64_t nbits, int64_t n, int64_t *len);
+
+/* set bits [start, start+n) */
+void bitmap_set_range(void *map, int64_t start, int64_t n);
+
+/* name of the kernels in use - "scalar", "popcnt" or "avx2" - and a way
+ * to force one (for benchmarks). bitmap_use returns -1 if the CPU
+ * can't run it.
+ */
+const char *bitmap_kernel(void);
+int bitmap_use(const char *name);
+
+#endif
@@ -7,6 +7,8 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
+#include <stdint.h>
+
 #define BLOCK_SIZE 1024
 
 struct blkdev {
@@ -15,10 +17,14 @@ struct blkdev {
 };
 
 struct blkdev_ops {
-    int  (*num_blocks)(struct blkdev *dev);
-    int  (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
-    int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
+    int64_t (*num_blocks)(struct blkdev *dev);
+    int  (*read)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+    int  (*write)(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf);
+    /* num_blks = 0 flushes the whole device to stable storage */
+    int  (*flush)(struct blkdev *dev, int64_t first_blk, int num_blks);
+    /* the blocks are free - their contents may be dropped, and read
+     * back as zeros or as anything else */
+    int  (*discard)(struct blkdev *dev, int64_t first_blk, int num_blks);
     void (*close)(struct blkdev *dev);
 };
 
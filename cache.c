@@ -0,0 +1,219 @@
+/*
+ * file:        cache.c
+ * description: block cache - see cache.h
+ *
+ * Entries are preallocated, found through a hash table of chains, and
+ * kept on an LRU list; a miss reuses the least recently used entry.
+ * Requests longer than MAX_FILL blocks are passed through without
+ * being added to the cache, so large sequential transfers don't flush
+ * out the metadata.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "probes.h"
+
+#define MAX_FILL 8
+
+struct entry {
+    int64_t blk;                /* -1 if unused */
+    struct entry *hnext;        /* hash chain */
+    struct entry *prev, *next;  /* LRU list, most recent first */
+    char *data;
+};
+
+struct cache {
+    struct blkdev *dev;
+    pthread_mutex_t lock;
+    int n, hash_sz;
+    struct entry *entries, **hash;
+    struct entry lru;           /* list head */
+    char *data;
+};
+
+static int hash(struct cache *c, int64_t blk)
+{
+    return (blk * 2654435761u) & (c->hash_sz - 1);
+}
+
+static struct entry *lookup(struct cache *c, int64_t blk)
+{
+    struct entry *e;
+    for (e = c->hash[hash(c, blk)]; e != NULL; e = e->hnext)
+        if (e->blk == blk)
+            return e;
+    return NULL;
+}
+
+static void unlink_lru(struct entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void push_lru(struct cache *c, struct entry *e)
+{
+    e->next = c->lru.next;
+    e->prev = &c->lru;
+    c->lru.next->prev = e;
+    c->lru.next = e;
+}
+
+static void unhash(struct cache *c, struct entry *e)
+{
+    struct entry **pp;
+    for (pp = &c->hash[hash(c, e->blk)]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+}
+
+/* put a copy of 'buf' in the cache as block 'blk' */
+static void fill(struct cache *c, int64_t blk, const void *buf)
+{
+    struct entry *e = lookup(c, blk);
+    if (e == NULL) {
+        e = c->lru.prev;        /* least recently used */
+        if (e->blk >= 0)
+            unhash(c, e);
+        e->blk = blk;
+        e->hnext = c->hash[hash(c, blk)];
+        c->hash[hash(c, blk)] = e;
+    }
+    unlink_lru(e);
+    push_lru(c, e);
+    memcpy(e->data, buf, BLOCK_SIZE);
+}
+
+static int64_t cache_num_blocks(struct blkdev *cdev)
+{
+    struct cache *c = cdev->private;
+    return c->dev->ops->num_blocks(c->dev);
+}
+
+static int cache_read(struct blkdev *cdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct cache *c = cdev->private;
+    struct entry *e;
+    int i, val = SUCCESS;
+
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < num_blks && (e = lookup(c, first_blk + i)) != NULL; i++) {
+        memcpy((char *)buf + (size_t)i * BLOCK_SIZE, e->data, BLOCK_SIZE);
+        unlink_lru(e);
+        push_lru(c, e);
+    }
+    if (i > 0)
+        PROBE2(cache_hit, first_blk, i);
+    if (i < num_blks) {
+        /* read the rest, from the first miss */
+        PROBE2(cache_miss, first_blk + i, num_blks - i);
+        char *p = (char *)buf + (size_t)i * BLOCK_SIZE;
+        val = c->dev->ops->read(c->dev, first_blk + i, num_blks - i, p);
+        if (val >= 0 && num_blks <= MAX_FILL)
+            for (; i < num_blks; i++, p += BLOCK_SIZE)
+                fill(c, first_blk + i, p);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return val;
+}
+
+static int cache_write(struct blkdev *cdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct cache *c = cdev->private;
+    struct entry *e;
+    int i, val;
+
+    pthread_mutex_lock(&c->lock);
+    val = c->dev->ops->write(c->dev, first_blk, num_blks, buf);
+    for (i = 0; val >= 0 && i < num_blks; i++) {
+        char *p = (char *)buf + (size_t)i * BLOCK_SIZE;
+        if (num_blks <= MAX_FILL)
+            fill(c, first_blk + i, p);
+        else if ((e = lookup(c, first_blk + i)) != NULL)
+            memcpy(e->data, p, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return val;
+}
+
+/* discarded blocks are dropped from the cache, to the LRU end */
+static int cache_discard(struct blkdev *cdev, int64_t first_blk, int num_blks)
+{
+    struct cache *c = cdev->private;
+    struct entry *e;
+    int i, val;
+
+    pthread_mutex_lock(&c->lock);
+    val = c->dev->ops->discard(c->dev, first_blk, num_blks);
+    for (i = 0; i < num_blks; i++)
+        if ((e = lookup(c, first_blk + i)) != NULL) {
+            unhash(c, e);
+            e->blk = -1;
+            unlink_lru(e);
+            e->prev = c->lru.prev;
+            e->next = &c->lru;
+            c->lru.prev->next = e;
+            c->lru.prev = e;
+        }
+    pthread_mutex_unlock(&c->lock);
+    return val;
+}
+
+static int cache_flush(struct blkdev *cdev, int64_t first_blk, int num_blks)
+{
+    struct cache *c = cdev->private;
+    return c->dev->ops->flush(c->dev, first_blk, num_blks);
+}
+
+static void cache_close(struct blkdev *cdev)
+{
+    struct cache *c = cdev->private;
+    c->dev->ops->close(c->dev);
+    free(c->entries);
+    free(c->hash);
+    free(c->data);
+    free(c);
+    free(cdev);
+}
+
+struct blkdev_ops cache_ops = {
+    .num_blocks = cache_num_blocks,
+    .read = cache_read,
+    .write = cache_write,
+    .flush = cache_flush,
+    .discard = cache_discard,
+    .close = cache_close
+};
+
+struct blkdev *cache_create(struct blkdev *dev, int nblks)
+{
+    struct blkdev *cdev = malloc(sizeof(*cdev));
+    struct cache *c = calloc(1, sizeof(*c));
+    int i;
+
+    if (cdev == NULL || c == NULL || nblks < 1)
+        return NULL;
+    c->dev = dev;
+    pthread_mutex_init(&c->lock, NULL);
+    c->n = nblks;
+    for (c->hash_sz = 16; c->hash_sz < 2 * nblks; c->hash_sz *= 2)
+        ;
+    c->entries = calloc(nblks, sizeof(struct entry));
+    c->hash = calloc(c->hash_sz, sizeof(struct entry *));
+    c->data = malloc((size_t)nblks * BLOCK_SIZE);
+    if (c->entries == NULL || c->hash == NULL || c->data == NULL)
+        return NULL;
+
+    c->lru.next = c->lru.prev = &c->lru;
+    for (i = 0; i < nblks; i++) {
+        c->entries[i].blk = -1;
+        c->entries[i].data = c->data + (size_t)i * BLOCK_SIZE;
+        push_lru(c, &c->entries[i]);
+    }
+    cdev->ops = &cache_ops;
+    cdev->private = c;
+    return cdev;
+}
@@ -0,0 +1,18 @@
+/*
+ * file:        cache.h
+ * description: block cache, as a blkdev wrapper
+ *
+ * An LRU cache of 'nblks' blocks in front of another device. It is
+ * write-through - a write goes to the device at once, and updates or
+ * adds the cached copy - so there is never anything to write back,
+ * and flush and close just pass through. Discarded blocks are
+ * dropped. It's safe to call from several threads.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "blkdev.h"
+
+extern struct blkdev *cache_create(struct blkdev *dev, int nblks);
+
+#endif
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# file:        frag-bench.sh
+# description: fragmentation benchmark - several files appended to in
+#              parallel, with and without delayed allocation, reporting
+#              extents per file and contiguity as counted by read-img
+#
+# usage: frag-bench.sh <mountpoint> [files] [KB per file]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [files] [KB per file]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1
+files=${2:-8}
+kb=${3:-256}
+disk=/tmp/$USER-frag.img
+
+for f in ./homework ./mkfs-x6 ./read-img; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+for mode in "" -delalloc; do
+    ./mkfs-x6 -size 16m $disk > /dev/null
+    ./homework $mode -image $disk $MNT || exit 1
+
+    # each appender keeps its file open and writes 4KB at a time
+    i=0
+    while [ $i -lt $files ] ; do
+        dd if=/dev/urandom of=$MNT/file.$i bs=4096 count=$((kb / 4)) 2>/dev/null &
+        i=$((i+1))
+    done
+    wait
+    unmount
+
+    ./read-img $disk | awk -v mode="${mode:-default}" -v kb=$kb '
+        /^file:/    { n++ }
+        /^extents:/ { total += $2; if ($2 > max) max = $2 }
+        END { printf "%-10s %d files x %dKB: extents per file avg %.1f max %d",
+                     mode, n, kb, n ? total / n : 0, max }'
+    ./read-img -a $disk | awk '/contiguity:/ { printf ", contiguity %s\n", $2 }'
+done
+rm -f $disk
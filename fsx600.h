@@ -9,7 +9,7 @@
 #define __CSX600_H__
 
 #define FS_BLOCK_SIZE 1024
-#define FS_MAGIC 0x37363030
+#define FS_MAGIC 0x37363031     /* '7601' - 64-bit inode size */
 
 /* Entry in a directory
  */
@@ -29,11 +29,22 @@ struct fs_super {
     uint32_t block_map_sz;       /* in blocks */
     uint32_t num_blocks;         /* total, including SB, bitmaps, inodes */
     uint32_t root_inode;        /* always inode 1 */
+    uint32_t free_blocks;        /* as of the last bitmap write - */
+    uint32_t free_inodes;        /*   recounted after an unclean unmount */
+    uint32_t journal_base;       /* metadata journal - see journal.h */
+    uint32_t journal_sz;         /* in blocks, 0 if none */
+    uint32_t state;              /* FS_CLEAN or FS_DIRTY */
 
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 11 * sizeof(uint32_t)]; 
 };
 
+/* 'state' is FS_DIRTY while mounted and FS_CLEAN after an unmount -
+ * only then are free_blocks and free_inodes known to be right. Images
+ * made before the field existed have 0, and are treated as dirty.
+ */
+enum {FS_CLEAN = 1, FS_DIRTY = 2};
+
 #define N_DIRECT 6
 struct fs_inode {
     uint16_t uid;
@@ -41,15 +52,23 @@ struct fs_inode {
     uint32_t mode;
     uint32_t ctime;
     uint32_t mtime;
-     int32_t size;
+     int64_t size;
     uint32_t direct[N_DIRECT];
     uint32_t indir_1;
     uint32_t indir_2;
-    uint32_t pad[3];            /* 64 bytes per inode */
+    uint32_t indir_3;           /* triple indirect - files up to ~16GB */
+    uint32_t blocks;            /* allocated, incl. indirect (64 bytes per inode) */
 };
 
 enum {INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode)};
 
+/* Data block pointers (direct[] and the entries of the last indirect
+ * level) with the top bit set are allocated but never written, e.g.
+ * preallocated by fallocate. They read as zeros.
+ */
+#define BLK_UNWRITTEN 0x80000000
+#define BLK_NUM(ptr) ((ptr) & ~BLK_UNWRITTEN)
+
 #endif
 
 
@@ -0,0 +1,96 @@
+/*
+ * file:        fsync-bench.c
+ * description: fsync benchmark - each thread appends small records to
+ *              its own file, fsyncing after every one, and the run
+ *              reports fsyncs/sec and fsync latency. With more threads
+ *              than one, concurrent fsyncs can share a device flush.
+ *
+ *  usage: fsync-bench <dir> [threads] [fsyncs per thread] [record bytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+static char *dir;
+static int n_fsyncs = 200, rec_size = 128;
+static double *lat;             /* per-fsync latency, n_fsyncs per thread */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *appender(void *arg)
+{
+    long t = (long)arg;
+    char path[256], rec[rec_size];
+    int i;
+
+    sprintf(path, "%s/fsync.%ld", dir, t);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        perror(path), exit(1);
+    memset(rec, 'a' + t % 26, rec_size);
+
+    for (i = 0; i < n_fsyncs; i++) {
+        if (write(fd, rec, rec_size) != rec_size)
+            perror("write"), exit(1);
+        double t0 = now();
+        if (fsync(fd) < 0)
+            perror("fsync"), exit(1);
+        lat[t * n_fsyncs + i] = now() - t0;
+    }
+    close(fd);
+    unlink(path);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    int i, threads = 1;
+
+    if (argc < 2) {
+        printf("usage: %s <dir> [threads] [fsyncs per thread] [record bytes]\n", argv[0]);
+        exit(1);
+    }
+    dir = argv[1];
+    if (argc > 2)
+        threads = atoi(argv[2]);
+    if (argc > 3)
+        n_fsyncs = atoi(argv[3]);
+    if (argc > 4)
+        rec_size = atoi(argv[4]);
+
+    int n = threads * n_fsyncs;
+    lat = calloc(n, sizeof(double));
+    pthread_t tid[threads];
+
+    double t0 = now();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, appender, (void *)(long)i);
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    double t = now() - t0;
+
+    double sum = 0;
+    for (i = 0; i < n; i++)
+        sum += lat[i];
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%3d threads x %d fsyncs (%dB appends): %6.0f fsyncs/sec, "
+           "latency avg %.2fms p50 %.2fms p99 %.2fms\n",
+           threads, n_fsyncs, rec_size, n / t, sum / n * 1e3,
+           lat[n / 2] * 1e3, lat[n * 99 / 100] * 1e3);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# file:        fsync-bench.sh
+# description: fsync benchmark - small appends with an fsync after each,
+#              from 1 to 16 threads at once (see fsync-bench.c), with
+#              and without delayed allocation
+#
+# usage: fsync-bench.sh <mountpoint> [fsyncs per thread]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [fsyncs per thread]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1
+n=${2:-200}
+disk=/tmp/$USER-fsync.img
+
+for f in ./homework ./mkfs-x6 ./fsync-bench; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      echo "(fsync-bench is built with 'make fsync-bench')"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+for mode in "" -delalloc; do
+    echo "${mode:-default}:"
+    ./mkfs-x6 -size 16m $disk > /dev/null
+    ./homework $mode -image $disk $MNT || exit 1
+    for threads in 1 4 16; do
+        ./fsync-bench $MNT $threads $n
+    done
+    unmount
+done
+rm -f $disk
@@ -16,11 +16,25 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
 
 #include "fsx600.h"
 #include "blkdev.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "cache.h"
+#include "iostat.h"
+#include "trace.h"
+#include "probes.h"
 
 extern int homework_part; /* set by '-part n' command-line option */
+extern int delalloc;      /* set by '-delalloc' - see delalloc_write */
+extern int commit_ms;     /* set by '-commit n' - journal commit interval */
+extern int lfs;           /* set by '-lfs' - log-structured data */
+extern int discard;       /* cleared by '-nodiscard' - see discard_thread */
+extern FILE *trace_fp;    /* opened by '-trace file' - see trace.h */
 
 /* 
  * disk access - the global variable 'disk' points to a blkdev
@@ -30,6 +44,16 @@ extern int homework_part; /* set by '-part n' command-line option */
  */
 extern struct blkdev *disk;
 
+/* fs_init puts a block cache (see cache.h) in front of the image, and
+ * if the image has a journal, replaces 'disk' with a journal device
+ * (see journal.h) on top of that, so all metadata goes through the
+ * journal. File data is written to 'data_disk', the cache - or with
+ * '-trace', a trace device in front of it, which records everything
+ * the cache is asked for.
+ */
+#define CACHE_BLKS 4096
+struct blkdev *data_disk;
+
 /* by defining bitmaps as 'fd_set' pointers, you can use existing
  * macros to handle them. 
  *   FD_ISSET(##, inode_map);
@@ -42,7 +66,12 @@ fd_set *block_map;
 fd_set *inode_map;
 int inode_map_base;
 
+/* the inode table is demand-paged: 'inodes' is reserved at mount but
+ * each block of it is read on first use (get_inode), as recorded in
+ * 'inode_blk_loaded'.
+ */
 struct fs_inode *inodes;
+uint64_t *inode_blk_loaded;
 int n_inodes;
 int inode_base;
 
@@ -53,52 +82,300 @@ int n_blocks;
 int root_inode;
 struct fs_super *super_block;
 
+// bitmap blocks changed since the last set_map
+char *inode_map_dirty;
+char *block_map_dirty;
+
+// free counts, kept up to date by blk_alloc/blk_free etc.
+int n_free_blks;
+int n_free_inodes;
+
+/* Freed blocks are discarded (see blkdev.h) in batches, by
+ * discard_thread: 'discard_map' collects the blocks freed since the
+ * last batch, and 'discard_busy' holds the batch being discarded,
+ * which happens outside fs_lock - a block in it can't be reused until
+ * the batch is done.
+ */
+#define DISCARD_MS 1000
+static fd_set *discard_map, *discard_busy;
+static int discard_pending;
+static pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // define constants
 int num_entry = FS_BLOCK_SIZE / sizeof(struct fs_dirent);
 int num_entry_in_blk = BLOCK_SIZE / sizeof(uint32_t);
 int direct_sz = N_DIRECT * BLOCK_SIZE;
 int indirect_level1_sz = BLOCK_SIZE / sizeof(uint32_t) * BLOCK_SIZE;
 int indirect_level2_sz = BLOCK_SIZE / sizeof(uint32_t) * BLOCK_SIZE / sizeof(uint32_t) * BLOCK_SIZE;
+off_t indirect_level3_sz = (off_t)(BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE / sizeof(uint32_t) * BLOCK_SIZE / sizeof(uint32_t) * BLOCK_SIZE;
+/* block I/O, tagged with the class of block for the I/O statistics
+ * (see iostat.h)
+ */
+static __thread uint64_t fs_blks_read, fs_blks_written;
+
+static int io_read(struct blkdev *dev, int tag, int64_t blk, int n, void *buf)
+{
+    io_tag = tag;
+    fs_blks_read += n;
+    PROBE3(blk_read, tag, blk, n);
+    return dev->ops->read(dev, blk, n, buf);
+}
+
+static int io_write(struct blkdev *dev, int tag, int64_t blk, int n, void *buf)
+{
+    io_tag = tag;
+    fs_blks_written += n;
+    PROBE3(blk_write, tag, blk, n);
+    return dev->ops->write(dev, blk, n, buf);
+}
+
 /* init - this is called once by the FUSE framework at startup. Ignore
  * the 'conn' argument.
  * recommended actions:
  *   - read superblock
- *   - allocate memory, read bitmaps and inodes
+ *   - allocate memory, read bitmaps (inodes are read on demand)
+ */
+static void *commit_thread(void *arg);
+static void *cleaner_thread(void *arg);
+static void *discard_thread(void *arg);
+
+/* per-operation statistics, read from the virtual file STATS_PATH -
+ * see op_begin/op_end
  */
+#define STATS_PATH "/.fsstats"
+static int stats_getattr(struct stat *sb);
+static int stats_open(struct fuse_file_info *fi);
+static int stats_read(char *buf, size_t len, off_t offset, struct fuse_file_info *fi);
+static void stats_release(struct fuse_file_info *fi);
+static void lfs_init(void);
+static void check_blocks(void);
+static void set_map();
+
 void *fs_init(struct fuse_conn_info *conn)
 {
     struct fs_super sb;
-    if (disk->ops->read(disk, 0, 1, &sb) < 0)
+    if (io_read(disk, IO_SUPER, 0, 1, &sb) < 0)
+        exit(1);
+    if (sb.magic != FS_MAGIC)
+    {
+        fprintf(stderr, "bad magic %08x (expected %08x)\n", sb.magic, FS_MAGIC);
         exit(1);
+    }
+
+    // replay the journal before reading anything else
+    data_disk = disk = cache_create(disk, CACHE_BLKS);
+    if (trace_fp != NULL)
+    {
+        data_disk = disk = trace_create(disk, trace_fp);
+    }
+    if (sb.journal_sz)
+    {
+        if ((disk = journal_create(data_disk, sb.journal_base, sb.journal_sz)) == NULL)
+            exit(1);
+        if (io_read(disk, IO_SUPER, 0, 1, &sb) < 0)
+            exit(1);
+        journal_set_interval(disk, commit_ms);
+        if (commit_ms > 0)
+        {
+            pthread_t thread;
+            pthread_create(&thread, NULL, commit_thread, NULL);
+            pthread_detach(thread);
+        }
+    }
 
     /* The inode map and block map are written directly to the disk after the superblock */
 
     inode_map_base = 1;
     inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map) < 0)
+    if (io_read(disk, IO_BITMAP, inode_map_base, sb.inode_map_sz, inode_map) < 0)
         exit(1);
 
     block_map_base = inode_map_base + sb.inode_map_sz;
     block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map) < 0)
+    if (io_read(disk, IO_BITMAP, block_map_base, sb.block_map_sz, block_map) < 0)
         exit(1);
 
+    inode_map_dirty = calloc(sb.inode_map_sz, 1);
+    block_map_dirty = calloc(sb.block_map_sz, 1);
+
     /* The inode data is written to the next set of blocks */
 
     inode_base = block_map_base + sb.block_map_sz;
     n_inodes = sb.inode_region_sz * INODES_PER_BLK;
-    inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes) < 0)
+    inodes = mmap(NULL, (size_t)sb.inode_region_sz * FS_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (inodes == MAP_FAILED)
         exit(1);
+    inode_blk_loaded = calloc((sb.inode_region_sz + 63) / 64, sizeof(uint64_t));
 
     /* your code here */
 
     n_blocks = sb.num_blocks;
     root_inode = sb.root_inode;
-    super_block = &sb;
+    super_block = malloc(sizeof(sb));
+    *super_block = sb;
+
+    // after a clean unmount the free counts can be trusted; otherwise
+    // check the block map and recount
+    if (sb.state == FS_CLEAN)
+    {
+        n_free_blks = sb.free_blocks;
+        n_free_inodes = sb.free_inodes;
+    }
+    else
+    {
+        check_blocks();
+        n_free_blks = n_blocks - bitmap_count(block_map, n_blocks);
+        n_free_inodes = n_inodes - bitmap_count(inode_map, n_inodes);
+    }
+
+    // mark the image dirty (on disk) before changing anything
+    super_block->state = FS_DIRTY;
+    set_map();
+    disk->ops->flush(disk, 0, 0);
+
+    if (discard)
+    {
+        pthread_t thread;
+        discard_map = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+        discard_busy = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+        pthread_create(&thread, NULL, discard_thread, NULL);
+        pthread_detach(thread);
+    }
+    if (lfs)
+    {
+        pthread_t thread;
+        lfs_init();
+        pthread_create(&thread, NULL, cleaner_thread, NULL);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/* get_inode - inode 'i', reading its block of the inode table in on
+ * first use. The inode map is the resident summary of the table: a
+ * block with no allocated inodes is never read, the zero-filled memory
+ * standing in for it. (Atomic, as check_blocks calls this from several
+ * threads.)
+ */
+static struct fs_inode *get_inode(int i)
+{
+    int blk = i / INODES_PER_BLK;
+    uint64_t bit = 1ULL << (blk % 64);
+    if (!(__atomic_load_n(&inode_blk_loaded[blk / 64], __ATOMIC_ACQUIRE) & bit))
+    {
+        if (bitmap_find_set(inode_map, blk * INODES_PER_BLK, (blk + 1) * INODES_PER_BLK) >= 0 &&
+            io_read(disk, IO_INODE, inode_base + blk, 1, &inodes[blk * INODES_PER_BLK]) < 0)
+        {
+            exit(1);
+        }
+        __atomic_fetch_or(&inode_blk_loaded[blk / 64], bit, __ATOMIC_RELEASE);
+    }
+    return &inodes[i];
+}
+
+/* check_blocks - consistency pass for an image that wasn't cleanly
+ * unmounted. CHECK_THREADS threads split the inode table between them
+ * and mark every block reachable from an allocated inode; then blocks
+ * marked in use that nothing reaches are freed, and reachable blocks
+ * marked free are marked in use. (The journal keeps the metadata
+ * consistent, so this mostly finds blocks leaked by a crash without
+ * one.)
+ */
+#define CHECK_THREADS 4
+
+static uint64_t *reachable;
+
+static void mark_reachable(uint32_t blk)
+{
+    blk = BLK_NUM(blk);
+    if (blk && blk < n_blocks)
+    {
+        __atomic_fetch_or(&reachable[blk / 64], 1ULL << (blk % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static void check_indir(uint32_t blk, int level)
+{
+    uint32_t tmp[num_entry_in_blk];
+    int i;
+    if (!blk || blk >= n_blocks)
+    {
+        return;
+    }
+    mark_reachable(blk);
+    if (io_read(disk, IO_INDIR, blk, 1, tmp) < 0)
+    {
+        exit(1);
+    }
+    for (i = 0; i < num_entry_in_blk; i++)
+    {
+        if (level == 1)
+        {
+            mark_reachable(tmp[i]);
+        }
+        else
+        {
+            check_indir(tmp[i], level - 1);
+        }
+    }
+}
+
+static void *check_inodes(void *arg)
+{
+    long t = (long)arg;
+    int i, j, end = (int64_t)n_inodes * (t + 1) / CHECK_THREADS;
+    for (i = (int64_t)n_inodes * t / CHECK_THREADS; (i = bitmap_find_set(inode_map, i, end)) >= 0; i++)
+    {
+        struct fs_inode *inode = get_inode(i);
+        for (j = 0; j < N_DIRECT; j++)
+        {
+            mark_reachable(inode->direct[j]);
+        }
+        check_indir(inode->indir_1, 1);
+        check_indir(inode->indir_2, 2);
+        check_indir(inode->indir_3, 3);
+    }
     return NULL;
 }
 
+static void check_blocks(void)
+{
+    pthread_t threads[CHECK_THREADS];
+    int i, n_leaked = 0, n_unmarked = 0;
+    int meta_end = inode_base + super_block->inode_region_sz;
+
+    reachable = calloc((n_blocks + 63) / 64, sizeof(uint64_t));
+    bitmap_set_range(reachable, 0, meta_end);
+    bitmap_set_range(reachable, super_block->journal_base, super_block->journal_sz);
+    for (i = 0; i < CHECK_THREADS; i++)
+    {
+        pthread_create(&threads[i], NULL, check_inodes, (void *)(long)i);
+    }
+    for (i = 0; i < CHECK_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; (i = bitmap_find_andnot(block_map, reachable, i, n_blocks)) >= 0; i++)
+    {
+        FD_CLR(i, block_map);
+        block_map_dirty[i / (8 * FS_BLOCK_SIZE)] = 1;
+        n_leaked++;
+    }
+    for (i = 0; (i = bitmap_find_andnot(reachable, block_map, i, n_blocks)) >= 0; i++)
+    {
+        FD_SET(i, block_map);
+        block_map_dirty[i / (8 * FS_BLOCK_SIZE)] = 1;
+        n_unmarked++;
+    }
+    if (n_leaked || n_unmarked)
+    {
+        fprintf(stderr, "unclean unmount: freed %d leaked blocks, marked %d in use\n", n_leaked, n_unmarked);
+    }
+    free(reachable);
+}
+
 // lookup the path
 static int lookup(const char *path)
 {
@@ -129,11 +406,11 @@ static int lookup(const char *path)
                 return -ENOTDIR;
             }
         }
-        cur_inode = &inodes[inode_index];
+        cur_inode = get_inode(inode_index);
 
         // reset entry
         bzero(entry, num_entry * sizeof(struct fs_dirent));
-        if (disk->ops->read(disk, cur_inode->direct[0], 1, entry) < 0)
+        if (io_read(disk, IO_DIR, cur_inode->direct[0], 1, entry) < 0)
         {
             exit(1);
         }
@@ -182,7 +459,10 @@ static int setStat(struct fs_inode *inode, struct stat *sb)
     sb->st_mtime = inode->mtime;
     sb->st_size = inode->size;
     sb->st_nlink = 1;
-    sb->st_blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    // files report real allocation in 512-byte units (so holes don't
+    // count); directories always report zero size and blocks
+    if (S_ISREG(inode->mode))
+        sb->st_blocks = (blkcnt_t)inode->blocks * (FS_BLOCK_SIZE / 512);
 
     return SUCCESS;
 }
@@ -220,14 +500,17 @@ static int setStat(struct fs_inode *inode, struct stat *sb)
  */
 static int fs_getattr(const char *path, struct stat *sb)
 {
-    fs_init(NULL);
+    if (!strcmp(path, STATS_PATH))
+    {
+        return stats_getattr(sb);
+    }
     int inode_index = lookup(path);
     // directory not exists
     if (inode_index < 0)
     {
         return inode_index;
     }
-    int val = setStat(&inodes[inode_index], sb);
+    int val = setStat(get_inode(inode_index), sb);
     return val;
 }
 
@@ -250,14 +533,14 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t
     {
         return inode_index;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     // check whether path is directory
     if (!S_ISDIR(inode->mode))
         return -ENOTDIR;
 
     struct fs_dirent entry[num_entry];
     struct stat sb;
-    if (disk->ops->read(disk, inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -266,7 +549,7 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler, off_t
     {
         if (entry[i].valid)
         {
-            setStat(&inodes[entry[i].inode], &sb);
+            setStat(get_inode(entry[i].inode), &sb);
             filler(ptr, entry[i].name, &sb, 0);
         }
     }
@@ -287,7 +570,7 @@ static int is_dir(const char *path)
         return -ENOENT;
     }
     // check whether path is directory
-    if (!S_ISDIR(inodes[inode_index].mode))
+    if (!S_ISDIR(get_inode(inode_index)->mode))
     {
         return -ENOTDIR;
     }
@@ -304,7 +587,7 @@ static int is_file(const char *path)
     {
         return -ENOENT;
     }
-    if (S_ISDIR(inodes[inode_index].mode))
+    if (S_ISDIR(get_inode(inode_index)->mode))
     {
         return -EISDIR;
     }
@@ -314,67 +597,167 @@ static int is_file(const char *path)
 static int fs_opendir(const char *path, struct fuse_file_info *fi)
 {
     int val;
-    if (is_dir(path)) {
+    if ((val = is_dir(path)) == SUCCESS) {
         fi->fh = lookup(path);
-        return SUCCESS;
     }
-    return -ENOTDIR;
+    return val;
 }
 
 static int fs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     int val;
-    if (is_dir(path)) {
+    if ((val = is_dir(path)) == SUCCESS) {
         fi->fh = -1;
-        return SUCCESS;
     }
-
-    return -ENOTDIR;
+    return val;
 }
 
 static int search_available_inode()
 {
-    int i;
-    for (i = 2; i < n_inodes; i++)
+    int i = bitmap_find_zero(inode_map, 2, n_inodes);
+    return i < 0 ? -ENOSPC : i;
+}
+
+/* search_available_blk - find a free block. Its contents are left as
+ * they are: data blocks are always written in full by the write path,
+ * so only blocks read before they are written (indirect and directory
+ * blocks) need zero_blk.
+ */
+static int search_available_blk()
+{
+    int i = bitmap_find_zero(block_map, 0, n_blocks);
+    return i < 0 ? -ENOSPC : i;
+}
+
+static void zero_blk(int blk, int tag)
+{
+    char clear_buffer[BLOCK_SIZE];
+    bzero(clear_buffer, BLOCK_SIZE);
+    if (io_write(disk, tag, blk, 1, clear_buffer) < 0)
     {
-        if (!FD_ISSET(i, inode_map))
-        {
-            return i;
-        }
+        exit(1);
     }
-    return -ENOSPC;
 }
 
-static int search_available_blk()
+/* search_available_run - find the first run of 'n' free blocks, or
+ * failing that the longest free run. Blocks are not zeroed or marked
+ * in use. Returns the first block and sets *len to the run length.
+ */
+static int search_available_run(int n, int *len)
 {
-    int i;
-    for (i = 0; i < n_blocks; i++)
+    int64_t run_len;
+    int start = bitmap_find_run(block_map, n_blocks, n, &run_len);
+    if (start < 0)
+    {
+        return -ENOSPC;
+    }
+    *len = run_len;
+    return start;
+}
+
+/* blk_alloc, blk_free, inode_alloc, inode_free - mark a block or
+ * inode in use or free in the in-memory bitmaps, keeping the free
+ * counts in step. set_map writes the result.
+ */
+static void blk_alloc(int blk)
+{
+    if (!FD_ISSET(blk, block_map))
     {
-        if (!FD_ISSET(i, block_map))
+        PROBE1(blk_alloc, blk);
+        FD_SET(blk, block_map);
+        n_free_blks--;
+        block_map_dirty[blk / (8 * FS_BLOCK_SIZE)] = 1;
+        if (discard)
         {
-            // resset block
-            char clear_buffer[BLOCK_SIZE];
-            bzero(clear_buffer, BLOCK_SIZE);
-            if (disk->ops->write(disk, i, 1, clear_buffer) < 0)
+            FD_CLR(blk, discard_map);
+            if (FD_ISSET(blk, discard_busy))
             {
-                exit(1);
+                // wait for the batch
+                pthread_mutex_lock(&discard_lock);
+                pthread_mutex_unlock(&discard_lock);
             }
-            return i;
         }
     }
-    return -ENOSPC;
 }
 
-static void set_map()
+// a freed block may be reused for file data, written around the
+// journal, so any journalled copy of it has to go
+static void blk_free(int blk)
 {
-    if (disk->ops->write(disk, inode_map_base, block_map_base - inode_map_base, inode_map) < 0)
+    if (FD_ISSET(blk, block_map))
     {
-        exit(1);
+        PROBE1(blk_free, blk);
+        FD_CLR(blk, block_map);
+        n_free_blks++;
+        block_map_dirty[blk / (8 * FS_BLOCK_SIZE)] = 1;
+        if (disk != data_disk)
+        {
+            journal_forget(disk, blk);
+        }
+        if (discard)
+        {
+            FD_SET(blk, discard_map);
+            discard_pending = 1;
+        }
+    }
+}
+
+static void inode_alloc(int inum)
+{
+    if (!FD_ISSET(inum, inode_map))
+    {
+        PROBE1(inode_alloc, inum);
+        FD_SET(inum, inode_map);
+        n_free_inodes--;
+        inode_map_dirty[inum / (8 * FS_BLOCK_SIZE)] = 1;
+    }
+}
+
+static void inode_free(int inum)
+{
+    if (FD_ISSET(inum, inode_map))
+    {
+        PROBE1(inode_free, inum);
+        FD_CLR(inum, inode_map);
+        n_free_inodes++;
+        inode_map_dirty[inum / (8 * FS_BLOCK_SIZE)] = 1;
+    }
+}
+
+// write the dirty blocks of a bitmap, a run at a time
+static void write_map(fd_set *map, int base, int n_blks, char *dirty)
+{
+    int i, j;
+    for (i = 0; i < n_blks; i = j)
+    {
+        for (j = i; j < n_blks && dirty[j]; j++)
+        {
+            dirty[j] = 0;
+        }
+        if (j == i)
+        {
+            j++;
+            continue;
+        }
+        if (io_write(disk, IO_BITMAP, base + i, j - i, (char *)map + i * FS_BLOCK_SIZE) < 0)
+        {
+            exit(1);
+        }
     }
-    if (disk->ops->write(disk, block_map_base, inode_base - block_map_base, block_map) < 0)
+}
+
+// write the changed parts of both bitmaps, and the superblock with
+// the free counts
+static void set_map()
+{
+    super_block->free_blocks = n_free_blks;
+    super_block->free_inodes = n_free_inodes;
+    if (io_write(disk, IO_SUPER, 0, 1, super_block) < 0)
     {
         exit(1);
     }
+    write_map(inode_map, inode_map_base, block_map_base - inode_map_base, inode_map_dirty);
+    write_map(block_map, block_map_base, inode_base - block_map_base, block_map_dirty);
 }
 
 static void set_inode(int inode_index)
@@ -382,7 +765,7 @@ static void set_inode(int inode_index)
     int offset = inode_base + inode_index / INODES_PER_BLK;
     int index = inode_index - inode_index % INODES_PER_BLK;
 
-    if (disk->ops->write(disk, offset, 1, &inodes[index]) < 0)
+    if (io_write(disk, IO_INODE, offset, 1, &inodes[index]) < 0)
     {
         exit(1);
     }
@@ -401,6 +784,11 @@ static void set_inode(int inode_index)
  */
 static int fs_mknod(const char *path, mode_t mode, dev_t dev)
 {
+    // the statistics file is always there
+    if (!strcmp(path, STATS_PATH))
+    {
+        return -EEXIST;
+    }
     // make sure mode is regular file
     if (!S_ISREG(mode))
     {
@@ -434,13 +822,13 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
     }
 
     // find previous dir inode
-    struct fs_inode *dir_inode = &inodes[dir_inode_index];
+    struct fs_inode *dir_inode = get_inode(dir_inode_index);
     if (!S_ISDIR(dir_inode->mode))
     {
         return -ENOTDIR;
     }
     struct fs_dirent entry[num_entry];
-    if (disk->ops->read(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -474,20 +862,22 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
     entry[available_entry].inode = available_inode;
     entry[available_entry].isDir = 0;
     entry[available_entry].valid = 1;
-    FD_SET(available_inode, inode_map);
+    inode_alloc(available_inode);
 
     time_t ctime = time(NULL);
-    inodes[available_inode].uid = getuid();
-    inodes[available_inode].gid = getgid();
-    inodes[available_inode].mode = mode;
-    inodes[available_inode].ctime = ctime;
-    inodes[available_inode].mtime = ctime;
-    inodes[available_inode].size = 0;
+    struct fs_inode *new_inode = get_inode(available_inode);
+    new_inode->uid = getuid();
+    new_inode->gid = getgid();
+    new_inode->mode = mode;
+    new_inode->ctime = ctime;
+    new_inode->mtime = ctime;
+    new_inode->size = 0;
+    new_inode->blocks = 0;
 
     // write disk
     set_inode(available_inode);
     set_map();
-    if (disk->ops->write(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_write(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
         exit(1);
 
     return SUCCESS;
@@ -503,11 +893,12 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
  */
 static int fs_mkdir(const char *path, mode_t mode)
 {
-    // make sure mode is regular file
-    if (!S_ISREG(mode))
+    if (!strcmp(path, STATS_PATH))
     {
-        return -EINVAL;
+        return -EEXIST;
     }
+    // FUSE passes only the permission bits
+    mode = (mode & 01777) | S_IFDIR;
     if (strcmp(path, "/") == 0)
     {
         return -EINVAL;
@@ -538,14 +929,14 @@ static int fs_mkdir(const char *path, mode_t mode)
     }
 
     // find previous dir inode
-    struct fs_inode *dir_inode = &inodes[dir_inode_index];
+    struct fs_inode *dir_inode = get_inode(dir_inode_index);
     if (!S_ISDIR(dir_inode->mode))
     {
         return -ENOTDIR;
     }
 
     struct fs_dirent entry[num_entry];
-    if (disk->ops->read(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -579,15 +970,16 @@ static int fs_mkdir(const char *path, mode_t mode)
     entry[available_entry].inode = available_inode;
     entry[available_entry].isDir = 1;
     entry[available_entry].valid = 1;
-    FD_SET(available_inode, inode_map);
+    inode_alloc(available_inode);
 
     time_t ctime = time(NULL);
-    inodes[available_inode].uid = getuid();
-    inodes[available_inode].gid = getgid();
-    inodes[available_inode].mode = mode;
-    inodes[available_inode].ctime = ctime;
-    inodes[available_inode].mtime = ctime;
-    inodes[available_inode].size = 0;
+    struct fs_inode *new_inode = get_inode(available_inode);
+    new_inode->uid = getuid();
+    new_inode->gid = getgid();
+    new_inode->mode = mode;
+    new_inode->ctime = ctime;
+    new_inode->mtime = ctime;
+    new_inode->size = 0;
 
     // allocate block
     int available_blk = search_available_blk();
@@ -595,13 +987,15 @@ static int fs_mkdir(const char *path, mode_t mode)
     {
         return -ENOSPC;
     }
-    FD_SET(available_blk, block_map);
-    inodes[available_inode].direct[0] = available_blk;
+    zero_blk(available_blk, IO_DIR);
+    blk_alloc(available_blk);
+    new_inode->direct[0] = available_blk;
+    new_inode->blocks = 1;
 
     // write disk
     set_inode(available_inode);
     set_map();
-    if (disk->ops->write(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_write(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
         exit(1);
 
     return SUCCESS;
@@ -609,17 +1003,25 @@ static int fs_mkdir(const char *path, mode_t mode)
 
 /* truncate - truncate file to exactly 'len' bytes
  * Errors - path resolution, ENOENT, EISDIR, EINVAL
- *    return EINVAL if len > 0.
+ *    return EINVAL if len < 0.
+ *
+ * Growing a file just moves EOF - the new range is a hole. Shrinking
+ * frees only the blocks past the new EOF (pruning indirect blocks that
+ * become empty) and zeros the tail of the last partial block, so a
+ * later extend reads zeros there. Bitmap changes are written once, at
+ * the end.
  */
-static void truncate_indir_level1(int blk_num);
-static void truncate_indir_level2(int blk_num);
+static int truncate_indir_level1(struct fs_inode *inode, int blk_num, off_t start);
+static int truncate_indir_level2(struct fs_inode *inode, int blk_num, off_t start);
+static int truncate_indir_level3(struct fs_inode *inode, int blk_num, off_t start);
+static uint32_t get_blk(struct fs_inode *inode, off_t blk_num);
+static void zero_partial(struct fs_inode *inode, off_t offset, int len);
+static int delalloc_flush(int inode_index);
+static void delalloc_drop(int inode_index, off_t len);
 
 static int fs_truncate(const char *path, off_t len)
 {
-    /* you can cheat by only implementing this for the case of len==0,
-     * and an error otherwise.
-     */
-    if (len != 0)
+    if (len < 0)
         return -EINVAL; /* invalid argument */
 
     // get inode
@@ -631,114 +1033,359 @@ static int fs_truncate(const char *path, off_t len)
     {
         return inode_index;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     if (S_ISDIR(inode->mode))
     {
         return -EISDIR;
     }
+    if (len > direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz)
+    {
+        return -EFBIG;
+    }
+
+    // extend - leave a hole
+    if (len >= inode->size)
+    {
+        inode->size = len;
+        set_inode(inode_index);
+        return SUCCESS;
+    }
+
+    delalloc_drop(inode_index, len);
+
+    // zero the tail of the last partial block
+    if (len % BLOCK_SIZE)
+    {
+        zero_partial(inode, len, BLOCK_SIZE - len % BLOCK_SIZE);
+    }
+
+    // first block past the new EOF
+    off_t first = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    off_t level1_start = N_DIRECT;
+    off_t level2_start = level1_start + num_entry_in_blk;
+    off_t level3_start = level2_start + (off_t)num_entry_in_blk * num_entry_in_blk;
 
     // reset blks
     int i = 0;
-    for (i = 0; i < N_DIRECT; i++)
+    for (i = first; i < N_DIRECT; i++)
     {
         if (inode->direct[i])
         {
-            FD_CLR(inode->direct[i], block_map);
-            set_map();
+            blk_free(BLK_NUM(inode->direct[i]));
+            inode->blocks--;
         }
         inode->direct[i] = 0;
     }
 
     // reset dir_level1 blks
-    if (inode->indir_1)
-        truncate_indir_level1(inode->indir_1);
+    if (inode->indir_1 &&
+        truncate_indir_level1(inode, inode->indir_1, first > level1_start ? first - level1_start : 0))
+    {
+        inode->indir_1 = 0;
+    }
 
     // reset dir_level2 blks
-    if (inode->indir_2)
+    if (inode->indir_2 &&
+        truncate_indir_level2(inode, inode->indir_2, first > level2_start ? first - level2_start : 0))
+    {
+        inode->indir_2 = 0;
+    }
+
+    // reset dir_level3 blks
+    if (inode->indir_3 &&
+        truncate_indir_level3(inode, inode->indir_3, first > level3_start ? first - level3_start : 0))
     {
-        truncate_indir_level2(inode->indir_2);
+        inode->indir_3 = 0;
     }
 
-    inode->size = 0;
-    inode->indir_1 = 0;
-    inode->indir_2 = 0;
+    inode->size = len;
     set_inode(inode_index);
-    printf("truncate success");
+    set_map();
     return SUCCESS;
 }
 
-static void truncate_indir_level1(int blk_num)
+/* free the blocks at index 'start' and up under an indirect block,
+ * where 'start' counts data blocks from the beginning of the range the
+ * block maps. Returns 1 if nothing is left and the indirect block
+ * itself was freed. Only the in-memory bitmap is updated.
+ */
+static int truncate_indir_level1(struct fs_inode *inode, int blk_num, off_t start)
 {
     // read from blocks
     int tmp[num_entry_in_blk];
     bzero(tmp, BLOCK_SIZE);
-    if (disk->ops->read(disk, blk_num, 1, tmp) < 0)
+    if (io_read(disk, IO_INDIR, blk_num, 1, tmp) < 0)
         exit(1);
 
     // reset blks
-    int i;
+    int i, used = 0, dirty = 0;
     for (i = 0; i < num_entry_in_blk; i++)
     {
-        if (tmp[i])
+        if (!tmp[i])
+        {
+            continue;
+        }
+        if (i >= start)
+        {
+            blk_free(BLK_NUM(tmp[i]));
+            inode->blocks--;
+            tmp[i] = 0;
+            dirty = 1;
+        }
+        else
         {
-            FD_CLR(tmp[i], block_map);
+            used = 1;
         }
     }
-    FD_CLR(blk_num, block_map);
-    set_map();
+    if (!used)
+    {
+        blk_free(blk_num);
+        inode->blocks--;
+        return 1;
+    }
+    if (dirty && io_write(disk, IO_INDIR, blk_num, 1, tmp) < 0)
+        exit(1);
+    return 0;
 }
 
-static void truncate_indir_level2(int blk_num)
+static int truncate_indir_level2(struct fs_inode *inode, int blk_num, off_t start)
 {
     // read from blks
     int tmp[num_entry_in_blk];
     bzero(tmp, BLOCK_SIZE);
-    if (disk->ops->read(disk, blk_num, 1, tmp) < 0)
+    if (io_read(disk, IO_INDIR, blk_num, 1, tmp) < 0)
         exit(1);
 
     // reset blks
-    int i;
+    int i, used = 0, dirty = 0;
+    off_t span = num_entry_in_blk;
     for (i = 0; i < num_entry_in_blk; i++)
     {
-        if (tmp[i])
+        if (!tmp[i])
+        {
+            continue;
+        }
+        if ((i + 1) * span <= start)
+        {
+            used = 1;
+        }
+        else if (truncate_indir_level1(inode, tmp[i], start > i * span ? start - i * span : 0))
         {
-            truncate_indir_level1(tmp[i]);
+            tmp[i] = 0;
+            dirty = 1;
+        }
+        else
+        {
+            used = 1;
         }
     }
-    FD_CLR(blk_num, block_map);
-    set_map();
+    if (!used)
+    {
+        blk_free(blk_num);
+        inode->blocks--;
+        return 1;
+    }
+    if (dirty && io_write(disk, IO_INDIR, blk_num, 1, tmp) < 0)
+        exit(1);
+    return 0;
 }
 
-/* unlink - delete a file
- *  Errors - path resolution, ENOENT, EISDIR
- * Note that you have to delete (i.e. truncate) all the data.
- */
-static int fs_unlink(const char *path)
+static int truncate_indir_level3(struct fs_inode *inode, int blk_num, off_t start)
 {
-    // delete all the data
-    printf("in unlink");
-    int val = fs_truncate(path, 0);
-    if (val != SUCCESS)
+    // read from blks
+    int tmp[num_entry_in_blk];
+    bzero(tmp, BLOCK_SIZE);
+    if (io_read(disk, IO_INDIR, blk_num, 1, tmp) < 0)
+        exit(1);
+
+    // reset blks
+    int i, used = 0, dirty = 0;
+    off_t span = (off_t)num_entry_in_blk * num_entry_in_blk;
+    for (i = 0; i < num_entry_in_blk; i++)
     {
-        return val;
+        if (!tmp[i])
+        {
+            continue;
+        }
+        if ((i + 1) * span <= start)
+        {
+            used = 1;
+        }
+        else if (truncate_indir_level2(inode, tmp[i], start > i * span ? start - i * span : 0))
+        {
+            tmp[i] = 0;
+            dirty = 1;
+        }
+        else
+        {
+            used = 1;
+        }
     }
-
-    // get preivous dir
-    char preivous[strlen(path) + 1];
-    strcpy(preivous, path);
-    preivous[strrchr(preivous, '/') - preivous] = '\0';
-    // set path to root
-    if (strlen(preivous) == 0)
+    if (!used)
     {
-        strcpy(preivous, "/");
+        blk_free(blk_num);
+        inode->blocks--;
+        return 1;
     }
-    struct fs_inode *preivous_inode = &inodes[lookup(preivous)];
+    if (dirty && io_write(disk, IO_INDIR, blk_num, 1, tmp) < 0)
+        exit(1);
+    return 0;
+}
 
-    char *file_name = strrchr(path, '/') + 1;
+/* get_blk - map a file block number to a disk block, 0 for a hole.
+ * Unwritten blocks are returned with BLK_UNWRITTEN set.
+ */
+static uint32_t get_blk(struct fs_inode *inode, off_t blk_num)
+{
+    int tmp[num_entry_in_blk];
+    int blk;
+
+    if (blk_num < N_DIRECT)
+    {
+        return inode->direct[blk_num];
+    }
+    blk_num -= N_DIRECT;
+
+    if (blk_num < num_entry_in_blk)
+    {
+        blk = inode->indir_1;
+    }
+    else if ((blk_num -= num_entry_in_blk) < num_entry_in_blk * num_entry_in_blk)
+    {
+        if (!inode->indir_2 || io_read(disk, IO_INDIR, inode->indir_2, 1, tmp) < 0)
+            return 0;
+        blk = tmp[blk_num / num_entry_in_blk];
+        blk_num %= num_entry_in_blk;
+    }
+    else
+    {
+        blk_num -= num_entry_in_blk * num_entry_in_blk;
+        if (!inode->indir_3 || io_read(disk, IO_INDIR, inode->indir_3, 1, tmp) < 0)
+            return 0;
+        blk = tmp[blk_num / (num_entry_in_blk * num_entry_in_blk)];
+        blk_num %= num_entry_in_blk * num_entry_in_blk;
+        if (!blk || io_read(disk, IO_INDIR, blk, 1, tmp) < 0)
+            return 0;
+        blk = tmp[blk_num / num_entry_in_blk];
+        blk_num %= num_entry_in_blk;
+    }
+
+    if (!blk || io_read(disk, IO_INDIR, blk, 1, tmp) < 0)
+        return 0;
+    return tmp[blk_num];
+}
+
+/* set_blk - point file block 'blk_num' at disk block 'val', allocating
+ * any missing indirect blocks on the way. Indirect blocks are written
+ * here; the caller writes the inode and the bitmaps.
+ */
+static int set_blk(struct fs_inode *inode, off_t blk_num, uint32_t val)
+{
+    uint32_t tmp[num_entry_in_blk];
+    uint32_t *slot;
+    off_t span;
+    int level, cur = 0;
+
+    if (blk_num < N_DIRECT)
+    {
+        inode->direct[blk_num] = val;
+        return SUCCESS;
+    }
+    blk_num -= N_DIRECT;
+
+    if (blk_num < num_entry_in_blk)
+    {
+        slot = &inode->indir_1;
+        level = 1;
+    }
+    else if ((blk_num -= num_entry_in_blk) < num_entry_in_blk * num_entry_in_blk)
+    {
+        slot = &inode->indir_2;
+        level = 2;
+    }
+    else
+    {
+        blk_num -= num_entry_in_blk * num_entry_in_blk;
+        slot = &inode->indir_3;
+        level = 3;
+    }
+
+    // walk down, 'cur' being the indirect block holding *slot
+    for (; level > 0; level--)
+    {
+        if (!*slot)
+        {
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+            {
+                return -ENOSPC;
+            }
+            zero_blk(available_blk, IO_INDIR);
+            blk_alloc(available_blk);
+            inode->blocks++;
+            *slot = available_blk;
+            if (cur && io_write(disk, IO_INDIR, cur, 1, tmp) < 0)
+                exit(1);
+        }
+        cur = *slot;
+        if (io_read(disk, IO_INDIR, cur, 1, tmp) < 0)
+            exit(1);
+        span = level == 3 ? num_entry_in_blk * num_entry_in_blk : level == 2 ? num_entry_in_blk : 1;
+        slot = &tmp[blk_num / span];
+        blk_num %= span;
+    }
+    *slot = val;
+    if (io_write(disk, IO_INDIR, cur, 1, tmp) < 0)
+        exit(1);
+    return SUCCESS;
+}
+
+/* zero_partial - zero 'len' bytes at 'offset' within a single block of
+ * the file, if that block has data on disk.
+ */
+static void zero_partial(struct fs_inode *inode, off_t offset, int len)
+{
+    uint32_t blk = get_blk(inode, offset / BLOCK_SIZE);
+    if (!blk || (blk & BLK_UNWRITTEN))
+        return;
+
+    char tmp[BLOCK_SIZE];
+    if (io_read(disk, IO_DATA, blk, 1, tmp) < 0)
+        exit(1);
+    memset(tmp + offset % BLOCK_SIZE, 0, len);
+    if (io_write(data_disk, IO_DATA, blk, 1, tmp) < 0)
+        exit(1);
+}
+
+/* unlink - delete a file
+ *  Errors - path resolution, ENOENT, EISDIR
+ * Note that you have to delete (i.e. truncate) all the data.
+ */
+static int fs_unlink(const char *path)
+{
+    // delete all the data
+    int val = fs_truncate(path, 0);
+    if (val != SUCCESS)
+    {
+        return val;
+    }
+
+    // get preivous dir
+    char preivous[strlen(path) + 1];
+    strcpy(preivous, path);
+    preivous[strrchr(preivous, '/') - preivous] = '\0';
+    // set path to root
+    if (strlen(preivous) == 0)
+    {
+        strcpy(preivous, "/");
+    }
+    struct fs_inode *preivous_inode = get_inode(lookup(preivous));
+
+    char *file_name = strrchr(path, '/') + 1;
 
     // remove entry
     struct fs_dirent entry[num_entry];
-    if (disk->ops->read(disk, preivous_inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, preivous_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -755,13 +1402,13 @@ static int fs_unlink(const char *path)
     }
 
     int inode_index = lookup(path);
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     memset(inode, 0, sizeof(struct fs_inode));
-    FD_CLR(inode_index, inode_map);
+    inode_free(inode_index);
     set_inode(inode_index);
     set_map();
     // write disk
-    if (disk->ops->write(disk, preivous_inode->direct[0], 1, entry) < 0)
+    if (io_write(disk, IO_DIR, preivous_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -794,7 +1441,7 @@ static int fs_rmdir(const char *path)
     {
         return dir_inode_index;
     }
-    struct fs_inode *dir_inode = &inodes[dir_inode_index];
+    struct fs_inode *dir_inode = get_inode(dir_inode_index);
     if (!S_ISDIR(dir_inode->mode))
     {
         return -ENOTDIR;
@@ -806,7 +1453,7 @@ static int fs_rmdir(const char *path)
     {
         return inode_index;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     if (!S_ISDIR(dir_inode->mode))
     {
         return -ENOTDIR;
@@ -814,7 +1461,7 @@ static int fs_rmdir(const char *path)
 
     // check whether dir is empty
     struct fs_dirent entry[num_entry];
-    if (disk->ops->read(disk, inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -832,7 +1479,7 @@ static int fs_rmdir(const char *path)
 
     // read preivous dir entry
     struct fs_dirent dir_entry[num_entry];
-    if (disk->ops->read(disk, dir_inode->direct[0], 1, dir_entry) < 0)
+    if (io_read(disk, IO_DIR, dir_inode->direct[0], 1, dir_entry) < 0)
     {
         exit(1);
     }
@@ -845,14 +1492,13 @@ static int fs_rmdir(const char *path)
             memset(&dir_entry[i], 0, sizeof(dir_entry[i]));
         }
     }
-    memset(inode, 0, sizeof(inode));
-
     // write map
-    FD_CLR(inode->direct[0], block_map);
-    FD_CLR(inode_index, inode_map);
+    blk_free(inode->direct[0]);
+    inode_free(inode_index);
+    memset(inode, 0, sizeof(*inode));
     set_inode(inode_index);
     set_map();
-    if (disk->ops->write(disk, dir_inode->direct[0], 1, dir_entry) < 0)
+    if (io_write(disk, IO_DIR, dir_inode->direct[0], 1, dir_entry) < 0)
     {
         exit(1);
     }
@@ -873,6 +1519,10 @@ static int fs_rmdir(const char *path)
  */
 static int fs_rename(const char *src_path, const char *dst_path)
 {
+    if (!strcmp(dst_path, STATS_PATH))
+    {
+        return -EEXIST;
+    }
     // check whether src and dst path exists
     int src_inode_index = lookup(src_path);
     if (src_inode_index < 0)
@@ -905,7 +1555,7 @@ static int fs_rename(const char *src_path, const char *dst_path)
     {
         return dir_inode_index;
     }
-    struct fs_inode *dir_inode = &inodes[dir_inode_index];
+    struct fs_inode *dir_inode = get_inode(dir_inode_index);
 
     // get name of src and dst
     char *src_name = strrchr(src_path, '/') + 1;
@@ -918,7 +1568,7 @@ static int fs_rename(const char *src_path, const char *dst_path)
 
     // rename entry
     struct fs_dirent entry[num_entry];
-    if (disk->ops->read(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_read(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -931,7 +1581,7 @@ static int fs_rename(const char *src_path, const char *dst_path)
             strcpy(entry[i].name, dst_name);
         }
     }
-    if (disk->ops->write(disk, dir_inode->direct[0], 1, entry) < 0)
+    if (io_write(disk, IO_DIR, dir_inode->direct[0], 1, entry) < 0)
     {
         exit(1);
     }
@@ -954,7 +1604,7 @@ static int fs_chmod(const char *path, mode_t mode)
     {
         return -ENOENT;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     if (S_ISDIR(inode->mode))
     {
         inode->mode = mode | S_IFDIR;
@@ -976,7 +1626,7 @@ int fs_utime(const char *path, struct utimbuf *ut)
     {
         return inode_index;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     inode->mtime = ut->modtime;
     set_inode(inode_index);
     return SUCCESS;
@@ -988,14 +1638,25 @@ int fs_utime(const char *path, struct utimbuf *ut)
  *   - if offset+len > file len, return bytes from offset to EOF
  *   - on error, return <0
  * Errors - path resolution, ENOENT, EISDIR
+ *
+ * Holes (zero block pointers at any level) read as zeros without
+ * touching the disk.
  */
+static int fs_read_hole(off_t range, off_t offset, int len, char *buf);
 static int fs_read_block(int blk_num, off_t offset, int len, char *buf);
 static int fs_read_direct(struct fs_inode *inode, off_t offset, size_t len, char *buf);
 static int fs_read_indir1(size_t blk, off_t offset, int len, char *buf);
 static int fs_read_indir2(size_t start_block, off_t offset, int len, char *buf);
+static int fs_read_indir3(size_t start_block, off_t offset, int len, char *buf);
+
+static void delalloc_read(int inode_index, char *buf, size_t len, off_t offset);
 
 static int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
+    if (!strcmp(path, STATS_PATH))
+    {
+        return stats_read(buf, len, offset, fi);
+    }
     char _path[strlen(path) + 1];
     strcpy(_path, path);
     int inode_index = lookup(_path);
@@ -1003,11 +1664,12 @@ static int fs_read(const char *path, char *buf, size_t len, off_t offset, struct
     {
         return inode_index;
     }
-    struct fs_inode *inode = &inodes[inode_index];
+    struct fs_inode *inode = get_inode(inode_index);
     if (!S_ISREG(inode->mode))
     {
         return -EISDIR;
     }
+    PROBE3(file_read, inode_index, (int64_t)offset, len);
 
     if (offset >= inode->size)
     {
@@ -1053,6 +1715,18 @@ static int fs_read(const char *path, char *buf, size_t len, off_t offset, struct
         buf += len_read;
         // printf("read indir2 success");
     }
+
+    // read level3
+    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz)
+    {
+        len_read = fs_read_indir3(inode->indir_3, offset - direct_sz - indirect_level1_sz - indirect_level2_sz, len_bak, buf);
+        offset += len_read;
+        len_bak -= len_read;
+        buf += len_read;
+    }
+    // dirty pages not yet on disk
+    delalloc_read(inode_index, buf - (len - len_bak), len - len_bak, offset - (len - len_bak));
+
     // return actual length read
     // printf("len: %d, read: %d\n", len, len - len_bak);
     return len - len_bak;
@@ -1069,9 +1743,10 @@ static int fs_read_direct(struct fs_inode *inode, off_t offset, size_t len, char
 
         len_read = blk_offset + len_bak > BLOCK_SIZE ? BLOCK_SIZE - blk_offset : len_bak;
 
-        if (!inode->direct[blk_num])
-            return len - len_bak;
-        len_read = fs_read_block(inode->direct[blk_num], blk_offset, len_read, buf);
+        if (!inode->direct[blk_num] || (inode->direct[blk_num] & BLK_UNWRITTEN))
+            memset(buf, 0, len_read);
+        else
+            len_read = fs_read_block(inode->direct[blk_num], blk_offset, len_read, buf);
 
         buf += len_read;
         len_bak -= len_read;
@@ -1081,8 +1756,13 @@ static int fs_read_direct(struct fs_inode *inode, off_t offset, size_t len, char
 
 static int fs_read_indir1(size_t blk, off_t offset, int len, char *buf)
 {
+    if (!blk)
+    {
+        return fs_read_hole(indirect_level1_sz, offset, len, buf);
+    }
+
     int blk_index[num_entry_in_blk];
-    if (disk->ops->read(disk, blk, 1, blk_index) < 0)
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
     {
         exit(1);
     }
@@ -1103,11 +1783,14 @@ static int fs_read_indir1(size_t blk, off_t offset, int len, char *buf)
             len_read = len_bak;
         }
 
-        if (!blk_index[blk_num])
+        if (!blk_index[blk_num] || (blk_index[blk_num] & BLK_UNWRITTEN))
         {
-            return len - len_bak;
+            memset(buf, 0, len_read);
+        }
+        else
+        {
+            len_read = fs_read_block(blk_index[blk_num], blk_offset, len_read, buf);
         }
-        len_read = fs_read_block(blk_index[blk_num], blk_offset, len_read, buf);
 
         buf += len_read;
         len_bak -= len_read;
@@ -1118,8 +1801,13 @@ static int fs_read_indir1(size_t blk, off_t offset, int len, char *buf)
 
 static int fs_read_indir2(size_t blk, off_t offset, int len, char *buf)
 {
+    if (!blk)
+    {
+        return fs_read_hole(indirect_level2_sz, offset, len, buf);
+    }
+
     int blk_index[num_entry_in_blk];
-    if (disk->ops->read(disk, blk, 1, blk_index) < 0)
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
     {
         return 0;
     }
@@ -1147,6 +1835,55 @@ static int fs_read_indir2(size_t blk, off_t offset, int len, char *buf)
     return len - len_bak;
 }
 
+static int fs_read_indir3(size_t blk, off_t offset, int len, char *buf)
+{
+    if (!blk)
+    {
+        return fs_read_hole(indirect_level3_sz, offset, len, buf);
+    }
+
+    int blk_index[num_entry_in_blk];
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
+    {
+        return 0;
+    }
+
+    size_t len_read, len_bak = len;
+    int blk_num, blk_offset;
+    for (blk_num = offset / indirect_level2_sz, blk_offset = offset % indirect_level2_sz;
+         blk_num < num_entry_in_blk && len_bak > 0;
+         blk_num++)
+    {
+        if (blk_offset + len_bak > indirect_level2_sz)
+        {
+            len_read = indirect_level2_sz - blk_offset;
+        }
+        else
+        {
+            len_read = len_bak;
+        }
+
+        len_read = fs_read_indir2(blk_index[blk_num], blk_offset, len_read, buf);
+        buf += len_read;
+        len_bak -= len_read;
+        blk_offset = 0;
+    }
+    return len - len_bak;
+}
+
+/*
+*   read a hole - zero fill up to the end of the range it covers
+*/
+static int fs_read_hole(off_t range, off_t offset, int len, char *buf)
+{
+    if (offset + len > range)
+    {
+        len = range - offset;
+    }
+    memset(buf, 0, len);
+    return len;
+}
+
 /*
 *   read data from a block at offset
 */
@@ -1154,7 +1891,7 @@ static int fs_read_block(int blk_num, off_t offset, int len, char *buf)
 {
     char tmp[BLOCK_SIZE];
     bzero(tmp, BLOCK_SIZE);
-    if (disk->ops->read(disk, blk_num, 1, tmp) < 0)
+    if (io_read(disk, IO_DATA, blk_num, 1, tmp) < 0)
         exit(1);
     memcpy(buf, tmp + offset, len);
     return len;
@@ -1164,151 +1901,879 @@ static int fs_read_block(int blk_num, off_t offset, int len, char *buf)
  * It should return exactly the number of bytes requested, except on
  * error.
  * Errors - path resolution, ENOENT, EISDIR
- *  return EINVAL if 'offset' is greater than current file length.
- *  (POSIX semantics support the creation of files with "holes" in them, 
- *   but we don't)
+ *
+ * Writing past the current file length leaves a hole: only the blocks
+ * actually touched are allocated, and the skipped range reads as
+ * zeros. Likewise, an unallocated block that would only receive zeros
+ * is left as a hole rather than allocated.
  */
 static int fs_write_direct(size_t inode_index, off_t offset, size_t len, const char *buf);
-static int fs_write_indir1(size_t blk, off_t offset, int len, const char *buf);
-static int fs_write_indir2(size_t blk, off_t offset, int len, const char *buf);
+static int fs_write_indir1(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf);
+static int fs_write_indir2(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf);
+static int fs_write_indir3(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf);
 
-static int fs_write(const char *path, const char *buf, size_t len,
-                    off_t offset, struct fuse_file_info *fi)
+// check whether a buffer is all zeros
+static int is_zero(const char *buf, size_t len)
 {
-    char _path[strlen(path) + 1];
-    strcpy(_path, path);
-    int inode_index = lookup(_path);
-    if (inode_index < 0)
-    {
-        return inode_index;
-    }
-    struct fs_inode *inode = &inodes[inode_index];
-    if (!S_ISREG(inode->mode))
+    size_t i;
+    for (i = 0; i < len; i++)
     {
-        return -EISDIR;
+        if (buf[i])
+        {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    if (offset > inode->size)
-    {
-        return 0;
-    }
+/* delayed allocation - with '-delalloc', data written into holes is
+ * held in memory as dirty pages, with only a reservation against free
+ * space. Disk blocks are chosen when the file is flushed (flush,
+ * release, fsync, or when it has too many dirty pages), as a single
+ * contiguous run per file where possible, so that files growing side
+ * by side don't interleave. Writes to blocks already on disk go
+ * straight through.
+ */
+#define DELALLOC_MAX_PAGES 4096 /* per file */
 
-    size_t len_bak = len;
-    size_t len_write;
+struct dirty_page {
+    off_t blk_num;
+    struct dirty_page *next;
+    char data[BLOCK_SIZE];
+};
 
-    if (len_bak > 0 && offset < direct_sz)
-    {
-        len_write = fs_write_direct(inode_index, offset, len_bak, buf);
-        offset += len_write;
-        len_bak -= len_write;
-        buf += len_write;
-    }
+struct dirty_file {
+    int inode_index;
+    int n_pages;
+    struct dirty_page *pages; /* sorted by blk_num */
+    struct dirty_page *tail;
+    struct dirty_file *next;
+};
 
-    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz)
+static struct dirty_file *dirty_files;
+
+static int fs_write_data(int inode_index, const char *buf, size_t len, off_t offset);
+static int log_alloc(int n, int *len);
+static void lfs_clean(void);
+
+/* the file block each data block holds, for the cleaner */
+struct owner {
+    int inode_index;
+    uint32_t blk_num;
+};
+static struct owner *owner;
+
+static struct dirty_file *find_dirty(int inode_index)
+{
+    struct dirty_file *df;
+    for (df = dirty_files; df != NULL; df = df->next)
     {
-        if (!inode->indir_1)
+        if (df->inode_index == inode_index)
         {
-            int available_blk = search_available_blk();
-            if (available_blk < 0)
-            {
-                return len_bak - len;
-            }
-            inode->indir_1 = available_blk;
-            set_inode(inode_index);
-            FD_SET(available_blk, block_map);
-            set_map();
+            return df;
         }
-
-        // write to indir 1
-        len_write = fs_write_indir1(inode->indir_1, offset - direct_sz, len_bak, buf);
-        offset += len_write;
-        len_bak -= len_write;
-        buf += len_write;
     }
+    return NULL;
+}
 
-    // write indirect 2 blocks
-    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz + indirect_level2_sz)
+static void forget_dirty(struct dirty_file *df)
+{
+    struct dirty_file **pp;
+    for (pp = &dirty_files; *pp != df; pp = &(*pp)->next)
+        ;
+    *pp = df->next;
+    free(df);
+}
+
+// find the page for 'blk_num', or the page it should follow (NULL if
+// it goes first)
+static struct dirty_page *find_page(struct dirty_file *df, off_t blk_num, struct dirty_page **prev)
+{
+    struct dirty_page *pg;
+    *prev = NULL;
+    // appends land after the tail
+    if (df->tail && df->tail->blk_num <= blk_num)
     {
-        // allocate indir2
-        if (!inode->indir_2)
+        *prev = df->tail;
+        return df->tail->blk_num == blk_num ? df->tail : NULL;
+    }
+    for (pg = df->pages; pg != NULL && pg->blk_num <= blk_num; pg = pg->next)
+    {
+        if (pg->blk_num == blk_num)
         {
-            int available_blk = search_available_blk();
-            if (available_blk < 0)
-                return len_bak - len;
-            inode->indir_1 = available_blk;
-            set_inode(inode_index);
-            FD_SET(available_blk, block_map);
-            set_map();
+            return pg;
         }
-
-        len_write = fs_write_indir2(inode->indir_2, offset - direct_sz - indirect_level1_sz, len_bak, buf);
-        offset += len_write;
-        len_bak -= len_write;
-        buf += len_write;
+        *prev = pg;
     }
+    return NULL;
+}
 
-    if (offset > inode->size)
+// free blocks not yet promised to dirty pages, or to the indirect
+// blocks those pages may need
+static int unreserved_blks()
+{
+    int n_free = n_free_blks;
+    struct dirty_file *df;
+    for (df = dirty_files; df != NULL; df = df->next)
     {
-        inode->size = offset;
-        set_inode(inode_index);
+        n_free -= df->n_pages + df->n_pages / num_entry_in_blk + 3;
     }
-
-    return len - len_bak;
+    return n_free;
 }
 
-static int fs_write_direct(size_t inode_index, off_t offset, size_t len, const char *buf)
+static int delalloc_write(int inode_index, const char *buf, size_t len, off_t offset)
 {
-    struct fs_inode *inode = &inodes[inode_index];
-    size_t len_write, len_bak = len;
-    int blk_num, blk_offset;
-    for (blk_num = offset / BLOCK_SIZE, blk_offset = offset % BLOCK_SIZE;
-         blk_num < N_DIRECT && len_bak > 0;
-         blk_num++)
+    struct fs_inode *inode = get_inode(inode_index);
+    struct dirty_file *df = find_dirty(inode_index);
+    off_t max_sz = direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz;
+    off_t direct_start = offset;
+    size_t done = 0, direct_len = 0;
+    int avail = -1, val = SUCCESS;
+
+    if (offset >= max_sz)
     {
-        if (blk_offset + len_bak > BLOCK_SIZE)
-        {
-            len_write = BLOCK_SIZE - blk_offset;
-        }
-        else
+        return -EFBIG;
+    }
+    if (offset + len > max_sz)
+    {
+        len = max_sz - offset;
+    }
+
+    while (done < len)
+    {
+        off_t blk_num = (offset + done) / BLOCK_SIZE;
+        size_t n = BLOCK_SIZE - (offset + done) % BLOCK_SIZE;
+        if (n > len - done)
         {
-            len_write = len_bak;
+            n = len - done;
         }
-        len_bak -= len_write;
 
-        if (!inode->direct[blk_num])
+        struct dirty_page *prev = NULL, *pg = df ? find_page(df, blk_num, &prev) : NULL;
+        uint32_t old = pg ? 0 : get_blk(inode, blk_num);
+        if (old && !lfs)
         {
-            int available_blk = search_available_blk();
-            if (available_blk < 0)
+            // already on disk - batch up for fs_write_data
+            if (direct_len == 0)
             {
-                return len - len_bak;
+                direct_start = offset + done;
             }
-            inode->direct[blk_num] = available_blk;
-            set_inode(inode_index);
-            FD_SET(available_blk, block_map);
-            set_map();
-        }
-
-        char tmp[BLOCK_SIZE];
-        if (disk->ops->read(disk, inode->direct[blk_num], 1, tmp) < 0)
-        {
-            exit(1);
+            direct_len += n;
+            done += n;
+            continue;
         }
-        memcpy(tmp + blk_offset, buf, len_write);
-        if (disk->ops->write(disk, inode->direct[blk_num], 1, tmp) < 0)
+        if (direct_len > 0)
         {
-            exit(1);
+            if ((val = fs_write_data(inode_index, buf + (direct_start - offset), direct_len, direct_start)) < 0)
+            {
+                return done - direct_len > 0 ? done - direct_len : val;
+            }
+            direct_len = 0;
         }
-        buf += len_write;
-        blk_offset = 0;
-    }
-    return len - len_bak;
-}
 
-static int fs_write_indir1(size_t blk, off_t offset, int len, const char *buf)
-{
-    int blk_index[num_entry_in_blk];
-    if (disk->ops->read(disk, blk, 1, blk_index) < 0)
-    {
+        if (!pg)
+        {
+            // zeros into a hole stay a hole
+            if (!old && is_zero(buf + done, n))
+            {
+                done += n;
+                continue;
+            }
+            if (avail < 0)
+            {
+                avail = unreserved_blks();
+            }
+            if (avail-- <= 0)
+            {
+                val = -ENOSPC;
+                break;
+            }
+            if (!df)
+            {
+                df = calloc(1, sizeof(*df));
+                df->inode_index = inode_index;
+                df->next = dirty_files;
+                dirty_files = df;
+                prev = NULL;
+            }
+            pg = calloc(1, sizeof(*pg));
+            pg->blk_num = blk_num;
+            pg->next = prev ? prev->next : df->pages;
+            if (prev)
+            {
+                prev->next = pg;
+            }
+            else
+            {
+                df->pages = pg;
+            }
+            if (pg->next == NULL)
+            {
+                df->tail = pg;
+            }
+            df->n_pages++;
+
+            // an overwrite (lfs) starts from the block on disk
+            if (old && n < BLOCK_SIZE && !(old & BLK_UNWRITTEN) &&
+                io_read(data_disk, IO_DATA, BLK_NUM(old), 1, pg->data) < 0)
+            {
+                exit(1);
+            }
+        }
+        memcpy(pg->data + (offset + done) % BLOCK_SIZE, buf + done, n);
+        done += n;
+    }
+    if (direct_len > 0 && (val = fs_write_data(inode_index, buf + (direct_start - offset), direct_len, direct_start)) < 0)
+    {
+        done -= direct_len;
+    }
+
+    if (offset + done > inode->size)
+    {
+        inode->size = offset + done;
+    }
+    if (df && df->n_pages >= DELALLOC_MAX_PAGES)
+    {
+        delalloc_flush(inode_index);
+    }
+    return done > 0 ? done : val;
+}
+
+// copy any dirty pages in the range over what was read from disk
+static void delalloc_read(int inode_index, char *buf, size_t len, off_t offset)
+{
+    struct dirty_file *df = find_dirty(inode_index);
+    struct dirty_page *pg;
+    for (pg = df ? df->pages : NULL; pg != NULL; pg = pg->next)
+    {
+        off_t pos = pg->blk_num * BLOCK_SIZE;
+        off_t lo = pos > offset ? pos : offset;
+        off_t hi = pos + BLOCK_SIZE < offset + (off_t)len ? pos + BLOCK_SIZE : offset + (off_t)len;
+        if (lo < hi)
+        {
+            memcpy(buf + (lo - offset), pg->data + (lo - pos), hi - lo);
+        }
+    }
+}
+
+/* delalloc_flush - allocate and write out a file's dirty pages. The
+ * data is written before any pointer to it, one run at a time.
+ */
+static int delalloc_flush(int inode_index)
+{
+    struct dirty_file *df = find_dirty(inode_index);
+    if (df == NULL)
+    {
+        return SUCCESS;
+    }
+    struct fs_inode *inode = get_inode(inode_index);
+    int val = SUCCESS;
+
+    while (df->pages != NULL)
+    {
+        int i, run_len;
+        int start = lfs ? log_alloc(df->n_pages, &run_len) : search_available_run(df->n_pages, &run_len);
+        if (start < 0)
+        {
+            val = -ENOSPC;
+            break;
+        }
+
+        // reserve the run first, so indirect blocks come from elsewhere
+        for (i = 0; i < run_len; i++)
+        {
+            blk_alloc(start + i);
+        }
+
+        char *run_buf = malloc((size_t)run_len * BLOCK_SIZE);
+        struct dirty_page *pg = df->pages;
+        for (i = 0; i < run_len; i++, pg = pg->next)
+        {
+            memcpy(run_buf + (size_t)i * BLOCK_SIZE, pg->data, BLOCK_SIZE);
+        }
+        if (io_write(data_disk, IO_DATA, start, run_len, run_buf) < 0)
+        {
+            exit(1);
+        }
+        free(run_buf);
+
+        for (i = 0; i < run_len; i++)
+        {
+            pg = df->pages;
+            uint32_t old = lfs ? get_blk(inode, pg->blk_num) : 0;
+            if (set_blk(inode, pg->blk_num, start + i) < 0)
+            {
+                break;
+            }
+            if (old)
+            {
+                blk_free(BLK_NUM(old));
+            }
+            else
+            {
+                inode->blocks++;
+            }
+            if (lfs)
+            {
+                owner[start + i] = (struct owner){inode_index, pg->blk_num};
+            }
+            df->pages = pg->next;
+            df->n_pages--;
+            free(pg);
+        }
+        if (i < run_len)
+        {
+            for (; i < run_len; i++)
+            {
+                blk_free(start + i);
+            }
+            val = -ENOSPC;
+            break;
+        }
+    }
+
+    set_inode(inode_index);
+    set_map();
+    if (df->pages == NULL)
+    {
+        forget_dirty(df);
+    }
+    return val;
+}
+
+/* delalloc_drop - discard dirty pages past 'len', and zero the tail of
+ * the one containing it.
+ */
+static void delalloc_drop(int inode_index, off_t len)
+{
+    struct dirty_file *df = find_dirty(inode_index);
+    struct dirty_page **pp, *pg;
+    if (df == NULL)
+    {
+        return;
+    }
+    df->tail = NULL;
+    for (pp = &df->pages; (pg = *pp) != NULL;)
+    {
+        if (pg->blk_num * BLOCK_SIZE >= len)
+        {
+            *pp = pg->next;
+            df->n_pages--;
+            free(pg);
+            continue;
+        }
+        if (pg->blk_num == len / BLOCK_SIZE)
+        {
+            memset(pg->data + len % BLOCK_SIZE, 0, BLOCK_SIZE - len % BLOCK_SIZE);
+        }
+        df->tail = pg;
+        pp = &pg->next;
+    }
+    if (df->pages == NULL)
+    {
+        forget_dirty(df);
+    }
+}
+
+/* log-structured data - with '-lfs' (which implies -delalloc) writes
+ * to blocks already on disk are held as dirty pages too, and flushing
+ * appends a file's pages at the head of the log instead of finding
+ * them a free run. The log fills one free segment of LFS_SEG_BLKS
+ * blocks after another; each page's pointer moves to its new block
+ * and the old block is freed. Random small writes into a file thus
+ * become sequential writes, with no read for whole blocks.
+ *
+ * Overwrites leave dead blocks behind in older segments. The cleaner
+ * thread keeps LFS_CLEAN_LOW segments free by copying the live blocks
+ * of the emptiest segments into the log (and the log cleans for itself
+ * if it runs out). It finds each block's file
+ * through 'owner', built at mount and kept up as the log is written;
+ * an entry is only trusted if the file still points at the block, and
+ * segments holding anything else (directories, indirect blocks) are
+ * left alone.
+ */
+#define LFS_SEG_BLKS 64 /* one 64-bit word of the block map */
+#define LFS_CLEAN_LOW 8
+#define LFS_CLEAN_MS 100
+
+static int log_head = -1, log_end = -1; /* free part of the log segment */
+
+static int n_segs()
+{
+    return n_blocks / LFS_SEG_BLKS;
+}
+
+static int seg_live(int seg)
+{
+    return bitmap_count((uint64_t *)block_map + seg, LFS_SEG_BLKS);
+}
+
+/* log_alloc - up to 'n' free blocks at the head of the log, moving on
+ * to the next free segment when this one is used up. With no free
+ * segment left it falls back to any free run. Blocks are not marked
+ * in use. Returns the first block and sets *len.
+ */
+static int log_alloc(int n, int *len)
+{
+    int i;
+    // skip blocks allocated behind the log's back (indirect blocks)
+    while (log_head >= 0 && log_head < log_end && FD_ISSET(log_head, block_map))
+    {
+        log_head++;
+    }
+    if (log_head < 0 || log_head >= log_end)
+    {
+        int seg = log_end < 0 ? 0 : log_end / LFS_SEG_BLKS;
+        for (i = 0; i < n_segs() && seg_live((seg + i) % n_segs()) != 0; i++)
+            ;
+        if (i == n_segs())
+        {
+            // out of segments - clean in the foreground, then try again
+            lfs_clean();
+            for (i = 0; i < n_segs() && seg_live((seg + i) % n_segs()) != 0; i++)
+                ;
+        }
+        if (i == n_segs())
+        {
+            log_head = log_end = -1;
+            return search_available_run(n, len);
+        }
+        log_head = (seg + i) % n_segs() * LFS_SEG_BLKS;
+        log_end = log_head + LFS_SEG_BLKS;
+    }
+    for (i = 0; i < n && log_head + i < log_end && !FD_ISSET(log_head + i, block_map); i++)
+        ;
+    *len = i;
+    log_head += i;
+    return log_head - i;
+}
+
+static void note_owner(uint32_t blk, int inode_index, off_t blk_num)
+{
+    if (blk && !(blk & BLK_UNWRITTEN) && blk < n_blocks)
+    {
+        owner[blk] = (struct owner){inode_index, blk_num};
+    }
+}
+
+// record the data blocks under indirect block 'blk', which maps file
+// blocks from 'blk_num' on
+static void scan_indir(int inode_index, uint32_t blk, int level, off_t blk_num)
+{
+    uint32_t tmp[num_entry_in_blk];
+    off_t span = level == 3 ? num_entry_in_blk * num_entry_in_blk : level == 2 ? num_entry_in_blk : 1;
+    int i;
+    if (!blk || io_read(disk, IO_INDIR, blk, 1, tmp) < 0)
+    {
+        return;
+    }
+    for (i = 0; i < num_entry_in_blk; i++)
+    {
+        if (level == 1)
+        {
+            note_owner(tmp[i], inode_index, blk_num + i);
+        }
+        else
+        {
+            scan_indir(inode_index, tmp[i], level - 1, blk_num + i * span);
+        }
+    }
+}
+
+/* lfs_init - build 'owner' from every file's block pointers */
+static void lfs_init(void)
+{
+    int i, j;
+    owner = calloc(n_blocks, sizeof(*owner));
+    for (i = 0; (i = bitmap_find_set(inode_map, i, n_inodes)) >= 0; i++)
+    {
+        struct fs_inode *inode = get_inode(i);
+        if (!S_ISREG(inode->mode))
+        {
+            continue;
+        }
+        for (j = 0; j < N_DIRECT; j++)
+        {
+            note_owner(inode->direct[j], i, j);
+        }
+        scan_indir(i, inode->indir_1, 1, N_DIRECT);
+        scan_indir(i, inode->indir_2, 2, N_DIRECT + num_entry_in_blk);
+        scan_indir(i, inode->indir_3, 3, N_DIRECT + num_entry_in_blk + num_entry_in_blk * num_entry_in_blk);
+    }
+}
+
+// does 'owner' still describe block 'blk'?
+static int owner_valid(int blk)
+{
+    struct owner *o = &owner[blk];
+    return o->inode_index > 0 && o->inode_index < n_inodes &&
+           FD_ISSET(o->inode_index, inode_map) && S_ISREG(get_inode(o->inode_index)->mode) &&
+           get_blk(get_inode(o->inode_index), o->blk_num) == blk;
+}
+
+/* clean_seg - copy the live blocks of segment 'seg' to the log. All of
+ * them must have valid owners.
+ */
+static void clean_seg(int seg)
+{
+    int first = seg * LFS_SEG_BLKS, n = 0, i, j;
+    int live[LFS_SEG_BLKS];
+    char *buf = malloc(LFS_SEG_BLKS * BLOCK_SIZE);
+
+    // one read of the whole segment
+    if (io_read(data_disk, IO_DATA, first, LFS_SEG_BLKS, buf) < 0)
+    {
+        exit(1);
+    }
+    for (i = 0; i < LFS_SEG_BLKS; i++)
+    {
+        if (FD_ISSET(first + i, block_map))
+        {
+            live[n++] = i;
+        }
+    }
+
+    for (i = 0; i < n;)
+    {
+        int run_len, start = log_alloc(n - i, &run_len);
+        if (start < 0 || (start < first + LFS_SEG_BLKS && start + run_len > first))
+        {
+            break;
+        }
+        char *run_buf = malloc((size_t)run_len * BLOCK_SIZE);
+        for (j = 0; j < run_len; j++)
+        {
+            blk_alloc(start + j);
+            memcpy(run_buf + (size_t)j * BLOCK_SIZE, buf + (size_t)live[i + j] * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        if (io_write(data_disk, IO_DATA, start, run_len, run_buf) < 0)
+        {
+            exit(1);
+        }
+        free(run_buf);
+
+        for (j = 0; j < run_len; j++, i++)
+        {
+            int old = first + live[i];
+            struct owner o = owner[old];
+            if (set_blk(get_inode(o.inode_index), o.blk_num, start + j) < 0)
+            {
+                blk_free(start + j);
+                continue;
+            }
+            owner[start + j] = o;
+            blk_free(old);
+            set_inode(o.inode_index);
+        }
+    }
+    free(buf);
+    set_map();
+}
+
+/* lfs_clean - while free segments are running low, clean the emptiest
+ * segment that is no more than half full and holds only file data.
+ */
+static void lfs_clean(void)
+{
+    static int cleaning;
+    int seg, i, n_free, best, best_live;
+    int log_seg = log_end < 0 ? -1 : log_end / LFS_SEG_BLKS - 1;
+
+    // clean_seg writes through the log, which may call us again
+    if (cleaning)
+    {
+        return;
+    }
+    cleaning = 1;
+    for (;;)
+    {
+        n_free = 0;
+        best = -1;
+        best_live = LFS_SEG_BLKS / 2 + 1;
+        for (seg = 0; seg < n_segs(); seg++)
+        {
+            if (seg_live(seg) == 0 && seg != log_seg)
+            {
+                n_free++;
+            }
+        }
+        if (n_free >= LFS_CLEAN_LOW)
+        {
+            break;
+        }
+
+        for (seg = 0; seg < n_segs(); seg++)
+        {
+            int n = seg_live(seg);
+            if (n > 0 && n < best_live && seg != log_seg)
+            {
+                // every live block has to be movable
+                for (i = seg * LFS_SEG_BLKS; i < (seg + 1) * LFS_SEG_BLKS; i++)
+                {
+                    if (FD_ISSET(i, block_map) && !owner_valid(i))
+                    {
+                        break;
+                    }
+                }
+                if (i == (seg + 1) * LFS_SEG_BLKS)
+                {
+                    best = seg;
+                    best_live = n;
+                }
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        clean_seg(best);
+        if (seg_live(best) != 0)
+        {
+            break;
+        }
+        log_seg = log_end < 0 ? -1 : log_end / LFS_SEG_BLKS - 1;
+    }
+    cleaning = 0;
+}
+
+static int fs_write(const char *path, const char *buf, size_t len,
+                    off_t offset, struct fuse_file_info *fi)
+{
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    int inode_index = lookup(_path);
+    if (inode_index < 0)
+    {
+        return inode_index;
+    }
+    if (!S_ISREG(get_inode(inode_index)->mode))
+    {
+        return -EISDIR;
+    }
+    PROBE3(file_write, inode_index, (int64_t)offset, len);
+    if (delalloc)
+    {
+        return delalloc_write(inode_index, buf, len, offset);
+    }
+    return fs_write_data(inode_index, buf, len, offset);
+}
+
+/* fs_write_data - write to the file's blocks on disk, allocating them
+ * as needed.
+ */
+static int fs_write_data(int inode_index, const char *buf, size_t len, off_t offset)
+{
+    struct fs_inode *inode = get_inode(inode_index);
+    uint32_t blocks = inode->blocks;
+    off_t max_sz = direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz;
+
+    // nothing can be written past the triple indirect range
+    if (offset >= max_sz)
+    {
+        return -EFBIG;
+    }
+    if (offset + len > max_sz)
+    {
+        len = max_sz - offset;
+    }
+    size_t len_bak = len;
+    size_t len_write;
+
+    if (len_bak > 0 && offset < direct_sz)
+    {
+        len_write = fs_write_direct(inode_index, offset, len_bak, buf);
+        offset += len_write;
+        len_bak -= len_write;
+        buf += len_write;
+    }
+
+    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz)
+    {
+        len_write = len_bak;
+        if (offset + len_write > direct_sz + indirect_level1_sz)
+        {
+            len_write = direct_sz + indirect_level1_sz - offset;
+        }
+
+        // allocate indir 1, unless the range is a hole
+        if (!inode->indir_1 && !is_zero(buf, len_write))
+        {
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+            {
+                return len - len_bak;
+            }
+            zero_blk(available_blk, IO_INDIR);
+            inode->indir_1 = available_blk;
+            inode->blocks++;
+            set_inode(inode_index);
+            blk_alloc(available_blk);
+            set_map();
+        }
+
+        // write to indir 1
+        if (inode->indir_1)
+        {
+            len_write = fs_write_indir1(inode, inode->indir_1, offset - direct_sz, len_write, buf);
+        }
+        offset += len_write;
+        len_bak -= len_write;
+        buf += len_write;
+    }
+
+    // write indirect 2 blocks
+    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz + indirect_level2_sz)
+    {
+        len_write = len_bak;
+        if (offset + len_write > direct_sz + indirect_level1_sz + indirect_level2_sz)
+        {
+            len_write = direct_sz + indirect_level1_sz + indirect_level2_sz - offset;
+        }
+
+        // allocate indir2
+        if (!inode->indir_2 && !is_zero(buf, len_write))
+        {
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+                return len - len_bak;
+            zero_blk(available_blk, IO_INDIR);
+            inode->indir_2 = available_blk;
+            inode->blocks++;
+            set_inode(inode_index);
+            blk_alloc(available_blk);
+            set_map();
+        }
+
+        if (inode->indir_2)
+        {
+            len_write = fs_write_indir2(inode, inode->indir_2, offset - direct_sz - indirect_level1_sz, len_write, buf);
+        }
+        offset += len_write;
+        len_bak -= len_write;
+        buf += len_write;
+    }
+
+    // write indirect 3 blocks
+    if (len_bak > 0 && offset < direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz)
+    {
+        len_write = len_bak;
+        if (offset + len_write > direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz)
+        {
+            len_write = direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz - offset;
+        }
+
+        // allocate indir3
+        if (!inode->indir_3 && !is_zero(buf, len_write))
+        {
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+                return len - len_bak;
+            zero_blk(available_blk, IO_INDIR);
+            inode->indir_3 = available_blk;
+            inode->blocks++;
+            set_inode(inode_index);
+            blk_alloc(available_blk);
+            set_map();
+        }
+
+        if (inode->indir_3)
+        {
+            len_write = fs_write_indir3(inode, inode->indir_3, offset - direct_sz - indirect_level1_sz - indirect_level2_sz, len_write, buf);
+        }
+        offset += len_write;
+        len_bak -= len_write;
+        buf += len_write;
+    }
+
+    if (offset > inode->size || inode->blocks != blocks)
+    {
+        if (offset > inode->size)
+        {
+            inode->size = offset;
+        }
+        set_inode(inode_index);
+    }
+
+    return len - len_bak;
+}
+
+static int fs_write_direct(size_t inode_index, off_t offset, size_t len, const char *buf)
+{
+    struct fs_inode *inode = get_inode(inode_index);
+    size_t len_write, len_bak = len;
+    int blk_num, blk_offset;
+    for (blk_num = offset / BLOCK_SIZE, blk_offset = offset % BLOCK_SIZE;
+         blk_num < N_DIRECT && len_bak > 0;
+         blk_num++)
+    {
+        if (blk_offset + len_bak > BLOCK_SIZE)
+        {
+            len_write = BLOCK_SIZE - blk_offset;
+        }
+        else
+        {
+            len_write = len_bak;
+        }
+        len_bak -= len_write;
+
+        if (!inode->direct[blk_num] || (inode->direct[blk_num] & BLK_UNWRITTEN))
+        {
+            // leave a hole rather than allocate a block of zeros
+            if (is_zero(buf, len_write))
+            {
+                buf += len_write;
+                blk_offset = 0;
+                continue;
+            }
+        }
+        int fresh = !inode->direct[blk_num];
+        if (fresh)
+        {
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+            {
+                return len - len_bak;
+            }
+            inode->direct[blk_num] = available_blk;
+            inode->blocks++;
+            set_inode(inode_index);
+            blk_alloc(available_blk);
+            set_map();
+        }
+
+        // first write to a new or preallocated block - nothing to
+        // read, the rest of the block is zero-filled in memory, and a
+        // preallocated pointer is marked written once the data is on disk
+        char tmp[BLOCK_SIZE];
+        int unwritten = inode->direct[blk_num] & BLK_UNWRITTEN;
+        if (fresh || unwritten)
+        {
+            bzero(tmp, BLOCK_SIZE);
+        }
+        else if (io_read(disk, IO_DATA, inode->direct[blk_num], 1, tmp) < 0)
+        {
+            exit(1);
+        }
+        memcpy(tmp + blk_offset, buf, len_write);
+        if (io_write(data_disk, IO_DATA, BLK_NUM(inode->direct[blk_num]), 1, tmp) < 0)
+        {
+            exit(1);
+        }
+        if (unwritten)
+        {
+            inode->direct[blk_num] = BLK_NUM(inode->direct[blk_num]);
+            set_inode(inode_index);
+        }
+        buf += len_write;
+        blk_offset = 0;
+    }
+    return len - len_bak;
+}
+
+static int fs_write_indir1(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf)
+{
+    int blk_index[num_entry_in_blk];
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
+    {
         exit(1);
     }
 
@@ -1322,8 +2787,20 @@ static int fs_write_indir1(size_t blk, off_t offset, int len, const char *buf)
         len_write = blk_offset + len_bak > BLOCK_SIZE ? BLOCK_SIZE - blk_offset : len_bak;
         len_bak -= len_write;
 
+        // leave a hole rather than allocate a block of zeros
+        if (!blk_index[blk_num] || (blk_index[blk_num] & BLK_UNWRITTEN))
+        {
+            if (is_zero(buf, len_write))
+            {
+                buf += len_write;
+                blk_offset = 0;
+                continue;
+            }
+        }
+
         // allocate block if not exists
-        if (!blk_index[blk_num])
+        int fresh = !blk_index[blk_num];
+        if (fresh)
         {
             int available_blk = search_available_blk();
             if (available_blk < 0)
@@ -1331,24 +2808,100 @@ static int fs_write_indir1(size_t blk, off_t offset, int len, const char *buf)
                 return len - len_bak;
             }
             blk_index[blk_num] = available_blk;
+            inode->blocks++;
 
-            if (disk->ops->write(disk, blk, 1, blk_index))
+            if (io_write(disk, IO_INDIR, blk, 1, blk_index))
             {
                 exit(1);
             }
-            FD_SET(available_blk, block_map);
+            blk_alloc(available_blk);
             set_map();
         }
 
+        // first write to a new or preallocated block - see fs_write_direct
         char tmp[BLOCK_SIZE];
-        if (disk->ops->read(disk, blk_index[blk_num], 1, tmp) < 0)
+        int unwritten = blk_index[blk_num] & BLK_UNWRITTEN;
+        if (fresh || unwritten)
+        {
+            bzero(tmp, BLOCK_SIZE);
+        }
+        else if (io_read(disk, IO_DATA, blk_index[blk_num], 1, tmp) < 0)
         {
             exit(1);
         }
         memcpy(tmp + blk_offset, buf, len_write);
-        if (disk->ops->write(disk, blk_index[blk_num], 1, tmp) < 0)
+        if (io_write(data_disk, IO_DATA, BLK_NUM(blk_index[blk_num]), 1, tmp) < 0)
+        {
+            exit(1);
+        }
+        if (unwritten)
+        {
+            blk_index[blk_num] = BLK_NUM(blk_index[blk_num]);
+            if (io_write(disk, IO_INDIR, blk, 1, blk_index) < 0)
+            {
+                exit(1);
+            }
+        }
+
+        buf += len_write;
+        blk_offset = 0;
+    }
+    return len - len_bak;
+}
+
+static int fs_write_indir2(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf)
+{
+    int blk_index[num_entry_in_blk];
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
+    {
+        exit(1);
+    }
+
+    size_t len_write, len_bak = len;
+    int blk_num, blk_offset;
+    for (blk_num = offset / indirect_level1_sz, blk_offset = offset % indirect_level1_sz;
+         blk_num < num_entry_in_blk && len_bak > 0;
+         blk_num++)
+    {
+        if (blk_offset + len_bak > indirect_level1_sz)
+        {
+            len_write = indirect_level1_sz - blk_offset;
+        }
+        else
+        {
+            len_write = len_bak;
+        }
+        len_bak -= len_write;
+
+        if (!blk_index[blk_num])
+        {
+            if (is_zero(buf, len_write))
+            {
+                buf += len_write;
+                blk_offset = 0;
+                continue;
+            }
+            int available_blk = search_available_blk();
+            if (available_blk < 0)
+            {
+                return len - len_bak;
+            }
+            zero_blk(available_blk, IO_INDIR);
+            blk_index[blk_num] = available_blk;
+            inode->blocks++;
+
+            if (io_write(disk, IO_INDIR, blk, 1, blk_index))
+            {
+                exit(1);
+            }
+            blk_alloc(available_blk);
+            set_map();
+        }
+
+        len_write = fs_write_indir1(inode, blk_index[blk_num], blk_offset, len_write, buf);
+        if (len_write == 0)
         {
-            exit(1);
+            return len - len_bak;
         }
 
         buf += len_write;
@@ -1357,23 +2910,23 @@ static int fs_write_indir1(size_t blk, off_t offset, int len, const char *buf)
     return len - len_bak;
 }
 
-static int fs_write_indir2(size_t blk, off_t offset, int len, const char *buf)
+static int fs_write_indir3(struct fs_inode *inode, size_t blk, off_t offset, int len, const char *buf)
 {
     int blk_index[num_entry_in_blk];
-    if (disk->ops->read(disk, blk, 1, blk_index) < 0)
+    if (io_read(disk, IO_INDIR, blk, 1, blk_index) < 0)
     {
         exit(1);
     }
 
     size_t len_write, len_bak = len;
     int blk_num, blk_offset;
-    for (blk_num = offset / BLOCK_SIZE, blk_offset = offset % BLOCK_SIZE;
+    for (blk_num = offset / indirect_level2_sz, blk_offset = offset % indirect_level2_sz;
          blk_num < num_entry_in_blk && len_bak > 0;
          blk_num++)
     {
-        if (blk_offset + len_bak > indirect_level1_sz)
+        if (blk_offset + len_bak > indirect_level2_sz)
         {
-            len_write = indirect_level1_sz - blk_offset;
+            len_write = indirect_level2_sz - blk_offset;
         }
         else
         {
@@ -1383,22 +2936,30 @@ static int fs_write_indir2(size_t blk, off_t offset, int len, const char *buf)
 
         if (!blk_index[blk_num])
         {
+            if (is_zero(buf, len_write))
+            {
+                buf += len_write;
+                blk_offset = 0;
+                continue;
+            }
             int available_blk = search_available_blk();
             if (available_blk < 0)
             {
                 return len - len_bak;
             }
+            zero_blk(available_blk, IO_INDIR);
             blk_index[blk_num] = available_blk;
+            inode->blocks++;
 
-            if (disk->ops->write(disk, blk, 1, blk_index))
+            if (io_write(disk, IO_INDIR, blk, 1, blk_index))
             {
                 exit(1);
             }
-            FD_SET(available_blk, block_map);
+            blk_alloc(available_blk);
             set_map();
         }
 
-        len_write = fs_write_indir1(blk_index[blk_num], blk_offset, len_write, buf);
+        len_write = fs_write_indir2(inode, blk_index[blk_num], blk_offset, len_write, buf);
         if (len_write == 0)
         {
             return len - len_bak;
@@ -1412,27 +2973,235 @@ static int fs_write_indir2(size_t blk, off_t offset, int len, const char *buf)
 
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
-    if (is_file(path))
+    int val;
+    if (!strcmp(path, STATS_PATH))
     {
-        fi->fh = lookup(path);
-        return SUCCESS;
+        return stats_open(fi);
     }
-    else
+    if ((val = is_file(path)) == SUCCESS)
     {
-        return EISDIR;
+        fi->fh = lookup(path);
     }
+    return val;
 }
 
 static int fs_release(const char *path, struct fuse_file_info *fi)
 {
     int val;
+    if (!strcmp(path, STATS_PATH))
+    {
+        stats_release(fi);
+        return SUCCESS;
+    }
     if ((val = is_file(path)) == SUCCESS)
     {
         fi->fh = -1;
+        val = delalloc_flush(lookup(path));
+    }
+    return val;
+}
+
+/* flush - called on each close() of a file descriptor; fsync - called
+ * to make a file's data stable. Either one gives any dirty pages their
+ * disk blocks and writes them out; fsync then waits for a device flush
+ * (see group_flush), while close() makes no durability promise.
+ */
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (!strcmp(path, STATS_PATH))
+    {
+        return SUCCESS;
+    }
+    int inode_index = lookup(path);
+    if (inode_index < 0)
+    {
+        return inode_index;
+    }
+    return delalloc_flush(inode_index);
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return fs_flush(path, fi);
+}
+
+/* fsyncdir - directories are all metadata, so there's nothing to write
+ * before the device flush.
+ */
+static int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int inode_index = lookup(path);
+    if (inode_index < 0)
+    {
+        return inode_index;
+    }
+    return SUCCESS;
+}
+
+/* fallocate - preallocate or deallocate space in a file
+ *   mode 0                   - allocate, extending the file if needed
+ *   FALLOC_FL_KEEP_SIZE      - allocate without changing the size
+ *   FALLOC_FL_PUNCH_HOLE     - (with KEEP_SIZE) free the range
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EFBIG, ENOSPC,
+ *          EOPNOTSUPP for any other mode
+ *
+ * Missing blocks in the range are taken from contiguous free runs and
+ * marked BLK_UNWRITTEN, so they read as zeros without I/O until they
+ * are written, and data later written into them lands contiguously.
+ */
+static int punch_hole(int inode_index, off_t offset, off_t len);
+
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                        struct fuse_file_info *fi)
+{
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    {
+        return -EOPNOTSUPP;
+    }
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+    {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || len <= 0)
+    {
+        return -EINVAL;
+    }
+    if (offset + len > direct_sz + indirect_level1_sz + indirect_level2_sz + indirect_level3_sz)
+    {
+        return -EFBIG;
+    }
+
+    char _path[strlen(path) + 1];
+    strcpy(_path, path);
+    int inode_index = lookup(_path);
+    if (inode_index < 0)
+    {
+        return inode_index;
+    }
+    struct fs_inode *inode = get_inode(inode_index);
+    if (!S_ISREG(inode->mode))
+    {
+        return -EISDIR;
+    }
+
+    // dirty pages need their blocks before the range is examined
+    int val = delalloc_flush(inode_index);
+    if (val < 0)
+    {
+        return val;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+    {
+        return punch_hole(inode_index, offset, len);
+    }
+
+    // count the holes in the range
+    off_t blk, first = offset / BLOCK_SIZE, last = (offset + len - 1) / BLOCK_SIZE;
+    int needed = 0;
+    for (blk = first; blk <= last; blk++)
+    {
+        if (!get_blk(inode, blk))
+        {
+            needed++;
+        }
+    }
+
+    // fill them from contiguous runs, in file order
+    blk = first;
+    while (needed > 0)
+    {
+        int i, run_len;
+        int start = search_available_run(needed, &run_len);
+        if (start < 0)
+        {
+            val = -ENOSPC;
+            break;
+        }
+
+        // reserve the run first, so indirect blocks come from elsewhere
+        for (i = 0; i < run_len; i++)
+        {
+            blk_alloc(start + i);
+        }
+        for (i = 0; i < run_len; blk++)
+        {
+            if (get_blk(inode, blk))
+            {
+                continue;
+            }
+            if (set_blk(inode, blk, (start + i) | BLK_UNWRITTEN) < 0)
+            {
+                break;
+            }
+            inode->blocks++;
+            i++;
+        }
+        if (i < run_len)
+        {
+            for (; i < run_len; i++)
+            {
+                blk_free(start + i);
+            }
+            val = -ENOSPC;
+            break;
+        }
+        needed -= run_len;
+    }
+
+    if (val == SUCCESS && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->size)
+    {
+        inode->size = offset + len;
     }
+    set_inode(inode_index);
+    set_map();
     return val;
 }
 
+/* punch_hole - free the whole blocks in the range and zero the partial
+ * blocks at either end. Indirect blocks are left in place even if they
+ * end up empty; truncate or unlink frees them.
+ */
+static int punch_hole(int inode_index, off_t offset, off_t len)
+{
+    struct fs_inode *inode = get_inode(inode_index);
+    off_t end = offset + len;
+    off_t blk, first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE, last = end / BLOCK_SIZE;
+
+    // partial blocks at either end
+    if (first > last)
+    {
+        zero_partial(inode, offset, len);
+    }
+    else
+    {
+        if (offset % BLOCK_SIZE)
+        {
+            zero_partial(inode, offset, BLOCK_SIZE - offset % BLOCK_SIZE);
+        }
+        if (end % BLOCK_SIZE)
+        {
+            zero_partial(inode, last * BLOCK_SIZE, end % BLOCK_SIZE);
+        }
+    }
+
+    // whole blocks
+    for (blk = first; blk < last; blk++)
+    {
+        uint32_t ptr = get_blk(inode, blk);
+        if (ptr)
+        {
+            blk_free(BLK_NUM(ptr));
+            inode->blocks--;
+            set_blk(inode, blk, 0);
+        }
+    }
+
+    set_inode(inode_index);
+    set_map();
+    return SUCCESS;
+}
+
 /* statfs - get file system statistics
  * see 'man 2 statfs' for description of 'struct statvfs'.
  * Errors - none. 
@@ -1448,22 +3217,406 @@ static int fs_statfs(const char *path, struct statvfs *st)
      *
      * this should work fine, but you may want to add code to
      * calculate the correct values later.
+     *
+     * The free counts are maintained as blocks and inodes are
+     * allocated and freed, so this doesn't scan the bitmaps. Space
+     * reserved for dirty pages (see delalloc_write) isn't available.
      */
     st->f_bsize = FS_BLOCK_SIZE;
-    st->f_blocks = n_blocks - (1 + super_block->inode_map_sz + super_block->inode_region_sz + super_block->block_map_sz + root_inode);/* probably want to */
-    st->f_bfree = st->f_blocks;  /* change these */
-    st->f_bavail = st->f_bfree; /* values */
+    st->f_blocks = n_blocks - (1 + super_block->inode_map_sz + super_block->inode_region_sz + super_block->block_map_sz + super_block->journal_sz + root_inode);
+    st->f_bfree = n_free_blks;
+    st->f_bavail = unreserved_blks() > 0 ? unreserved_blks() : 0;
+    st->f_files = n_inodes;
+    st->f_ffree = n_free_inodes;
+    st->f_favail = n_free_inodes;
     st->f_namemax = 27;
 
-    // traverse through all blocks and calculate blocks used
-    int i;
-    for(i = 0; i < n_blocks; i++) {
-        if(FD_ISSET(i, block_map)) {
-            st->f_bfree--;
+    return 0;
+}
+
+/* FUSE calls these from several threads at once, and they all share
+ * the bitmaps, the inode table and the dirty page lists - so each
+ * operation runs under a single file system lock. Each one is also a
+ * journal operation: its metadata commits along with the others in
+ * the running transaction, when that is '-commit' ms old (or at once
+ * with '-commit 0').
+ */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void op_done(void)
+{
+    if (disk != data_disk)
+    {
+        journal_op_done(disk);
+    }
+}
+
+/* Per-operation statistics: calls, latency (including waiting for
+ * the lock and, for fsync, the flush), and blocks read and written per
+ * call - both by the file system (io_read/io_write, cache hits
+ * included) and at the device (see iostat.h), which gives the I/O
+ * amplification of each operation. Journal commits count against the
+ * operation that triggered them, or not at all if the commit thread
+ * does them.
+ */
+struct op_stats {
+    const char *name;
+    uint64_t calls, blks_read, blks_written, dev_read, dev_written;
+    struct io_hist lat;
+};
+
+struct op_start {
+    uint64_t t, blks_read, blks_written, dev_read, dev_written;
+};
+
+static pthread_mutex_t op_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct op_start op_begin(void)
+{
+    return (struct op_start){io_now(), fs_blks_read, fs_blks_written,
+                             io_blks_read, io_blks_written};
+}
+
+static void op_end(struct op_stats *st, struct op_start *start)
+{
+    uint64_t ns = io_now() - start->t;
+    pthread_mutex_lock(&op_stats_lock);
+    st->calls++;
+    st->blks_read += fs_blks_read - start->blks_read;
+    st->blks_written += fs_blks_written - start->blks_written;
+    st->dev_read += io_blks_read - start->dev_read;
+    st->dev_written += io_blks_written - start->dev_written;
+    io_hist_add(&st->lat, ns);
+    pthread_mutex_unlock(&op_stats_lock);
+}
+
+// the path - every method's first argument - for the probes
+#define FIRST_ARG(a, ...) a
+
+#define LOCKED(name, params, args)        \
+    static struct op_stats name##_stats = {#name + 3}; \
+    static int name##_locked params       \
+    {                                     \
+        PROBE1(name##_entry, (uintptr_t)FIRST_ARG args); \
+        struct op_start start = op_begin(); \
+        pthread_mutex_lock(&fs_lock);     \
+        int val = name args;              \
+        op_done();                        \
+        pthread_mutex_unlock(&fs_lock);   \
+        op_end(&name##_stats, &start);    \
+        PROBE2(name##_return, (uintptr_t)FIRST_ARG args, val); \
+        return val;                       \
+    }
+
+// commit whatever the last operations left in the running transaction
+static void *commit_thread(void *arg)
+{
+    for (;;)
+    {
+        usleep(commit_ms * 1000);
+        pthread_mutex_lock(&fs_lock);
+        journal_commit(disk);
+        pthread_mutex_unlock(&fs_lock);
+    }
+    return NULL;
+}
+
+// with '-lfs', keep free segments for the log
+static void *cleaner_thread(void *arg)
+{
+    for (;;)
+    {
+        usleep(LFS_CLEAN_MS * 1000);
+        pthread_mutex_lock(&fs_lock);
+        lfs_clean();
+        op_done();
+        pthread_mutex_unlock(&fs_lock);
+    }
+    return NULL;
+}
+
+// discard the blocks in 'map', a run at a time, and clear it
+static void discard_blocks(fd_set *map)
+{
+    int64_t start, end;
+    for (start = bitmap_find_set(map, 0, n_blocks); start >= 0;
+         start = bitmap_find_set(map, end, n_blocks))
+    {
+        if ((end = bitmap_find_zero(map, start, n_blocks)) < 0)
+        {
+            end = n_blocks;
+        }
+        if (data_disk->ops->discard(data_disk, start, end - start) < 0)
+        {
+            exit(1);
         }
     }
-    
-    return 0;
+    memset(map, 0, super_block->block_map_sz * FS_BLOCK_SIZE);
+}
+
+// discard the blocks freed in the last DISCARD_MS. Until the frees
+// are committed the journal may still write or replay those blocks,
+// so commit first.
+static void *discard_thread(void *arg)
+{
+    for (;;)
+    {
+        usleep(DISCARD_MS * 1000);
+        pthread_mutex_lock(&fs_lock);
+        if (!discard_pending)
+        {
+            pthread_mutex_unlock(&fs_lock);
+            continue;
+        }
+        disk->ops->flush(disk, 0, 0);
+        pthread_mutex_lock(&discard_lock);
+        fd_set *batch = discard_map;
+        discard_map = discard_busy;
+        discard_busy = batch;
+        discard_pending = 0;
+        pthread_mutex_unlock(&fs_lock);
+
+        discard_blocks(batch);
+        pthread_mutex_unlock(&discard_lock);
+    }
+    return NULL;
+}
+
+/* Group flush: fsync callers that arrive while a device flush is in
+ * progress wait for it to finish, and then one of them flushes for all
+ * of them. Each caller has issued its writes before taking a ticket,
+ * so a flush started after ticket t has been handed out covers t.
+ */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long flush_requested, flush_done;
+static int flushing, flush_val;
+
+static int group_flush(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    unsigned long ticket = ++flush_requested;
+    while (flush_done < ticket)
+    {
+        if (flushing)
+        {
+            pthread_cond_wait(&flush_done_cond, &flush_lock);
+            continue;
+        }
+        // flush for every ticket handed out so far
+        unsigned long target = flush_requested;
+        flushing = 1;
+        pthread_mutex_unlock(&flush_lock);
+
+        pthread_mutex_lock(&fs_lock);
+        int val = disk->ops->flush(disk, 0, 0);
+        pthread_mutex_unlock(&fs_lock);
+
+        pthread_mutex_lock(&flush_lock);
+        flushing = 0;
+        flush_done = target;
+        flush_val = val;
+        pthread_cond_broadcast(&flush_done_cond);
+    }
+    int val = flush_val;
+    pthread_mutex_unlock(&flush_lock);
+    return val < 0 ? -EIO : SUCCESS;
+}
+
+// like LOCKED, then wait for the device flush outside the lock
+#define SYNCED(name, params, args)        \
+    static struct op_stats name##_stats = {#name + 3}; \
+    static int name##_locked params       \
+    {                                     \
+        PROBE1(name##_entry, (uintptr_t)FIRST_ARG args); \
+        struct op_start start = op_begin(); \
+        pthread_mutex_lock(&fs_lock);     \
+        int val = name args;              \
+        op_done();                        \
+        pthread_mutex_unlock(&fs_lock);   \
+        if (val >= 0)                     \
+            val = group_flush();          \
+        op_end(&name##_stats, &start);    \
+        PROBE2(name##_return, (uintptr_t)FIRST_ARG args, val); \
+        return val;                       \
+    }
+
+/* destroy - called at unmount. Write out dirty pages, mark the image
+ * clean, commit the journal, and discard what's left to discard.
+ * fs_lock stays held, so the background threads stop where they are
+ * and the caller can close the device.
+ */
+static void fs_destroy(void *private_data)
+{
+    pthread_mutex_lock(&fs_lock);
+    while (dirty_files != NULL)
+    {
+        if (delalloc_flush(dirty_files->inode_index) < 0)
+        {
+            break;
+        }
+    }
+    super_block->state = dirty_files == NULL ? FS_CLEAN : FS_DIRTY;
+    set_map();
+    disk->ops->flush(disk, 0, 0);
+    if (discard)
+    {
+        pthread_mutex_lock(&discard_lock);
+        discard_blocks(discard_map);
+        pthread_mutex_unlock(&discard_lock);
+    }
+}
+
+LOCKED(fs_getattr, (const char *path, struct stat *sb), (path, sb))
+LOCKED(fs_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(fs_readdir, (const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset,
+                    struct fuse_file_info *fi), (path, ptr, filler, offset, fi))
+LOCKED(fs_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(fs_mknod, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+LOCKED(fs_mkdir, (const char *path, mode_t mode), (path, mode))
+LOCKED(fs_unlink, (const char *path), (path))
+LOCKED(fs_rmdir, (const char *path), (path))
+LOCKED(fs_rename, (const char *src_path, const char *dst_path), (src_path, dst_path))
+LOCKED(fs_chmod, (const char *path, mode_t mode), (path, mode))
+LOCKED(fs_utime, (const char *path, struct utimbuf *ut), (path, ut))
+LOCKED(fs_truncate, (const char *path, off_t len), (path, len))
+LOCKED(fs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(fs_read, (const char *path, char *buf, size_t len, off_t offset,
+                 struct fuse_file_info *fi), (path, buf, len, offset, fi))
+LOCKED(fs_write, (const char *path, const char *buf, size_t len, off_t offset,
+                  struct fuse_file_info *fi), (path, buf, len, offset, fi))
+LOCKED(fs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+LOCKED(fs_flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+SYNCED(fs_fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+SYNCED(fs_fsyncdir, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+LOCKED(fs_statfs, (const char *path, struct statvfs *st), (path, st))
+LOCKED(fs_fallocate, (const char *path, int mode, off_t offset, off_t len,
+                      struct fuse_file_info *fi), (path, mode, offset, len, fi))
+
+static struct op_stats *all_stats[] = {
+    &fs_getattr_stats, &fs_opendir_stats, &fs_readdir_stats, &fs_releasedir_stats,
+    &fs_mknod_stats, &fs_mkdir_stats, &fs_unlink_stats, &fs_rmdir_stats,
+    &fs_rename_stats, &fs_chmod_stats, &fs_utime_stats, &fs_truncate_stats,
+    &fs_open_stats, &fs_read_stats, &fs_write_stats, &fs_release_stats,
+    &fs_flush_stats, &fs_fsync_stats, &fs_fsyncdir_stats, &fs_statfs_stats,
+    &fs_fallocate_stats,
+};
+#define N_STATS (sizeof(all_stats) / sizeof(all_stats[0]))
+
+/* the contents of STATS_PATH - a line per operation called so far,
+ * with latencies in microseconds and blocks per call. Returns the
+ * length, which may be more than 'len'.
+ */
+static int stats_text(char *buf, size_t len)
+{
+    int i, n = snprintf(buf, len, "%-10s %8s %9s %9s %9s %9s %7s %7s %7s %7s\n",
+                        "op", "calls", "avg_us", "p50_us", "p99_us", "max_us",
+                        "rd/call", "wr/call", "dev_rd", "dev_wr");
+    pthread_mutex_lock(&op_stats_lock);
+    for (i = 0; i < N_STATS; i++)
+    {
+        struct op_stats *st = all_stats[i];
+        if (st->calls == 0)
+        {
+            continue;
+        }
+        double calls = st->calls;
+        n += snprintf(buf + n, n < len ? len - n : 0,
+                      "%-10s %8llu %9.1f %9.1f %9.1f %9.1f %7.2f %7.2f %7.2f %7.2f\n",
+                      st->name, (unsigned long long)st->calls, st->lat.sum / 1e3 / calls,
+                      io_hist_quantile(&st->lat, 0.5) / 1e3,
+                      io_hist_quantile(&st->lat, 0.99) / 1e3, st->lat.max / 1e3,
+                      st->blks_read / calls, st->blks_written / calls,
+                      st->dev_read / calls, st->dev_written / calls);
+    }
+    pthread_mutex_unlock(&op_stats_lock);
+    return n;
+}
+
+#define STATS_MAX 4096
+
+static int stats_getattr(struct stat *sb)
+{
+    char buf[STATS_MAX];
+    memset(sb, 0, sizeof(*sb));
+    sb->st_mode = S_IFREG | 0444;
+    sb->st_nlink = 1;
+    sb->st_uid = getuid();
+    sb->st_gid = getgid();
+    sb->st_size = stats_text(buf, sizeof(buf));
+    sb->st_atime = sb->st_mtime = sb->st_ctime = time(NULL);
+    return SUCCESS;
+}
+
+/* each open file gets a snapshot, so that reading it in pieces gives
+ * consistent text - and as the size changes, no caching either
+ */
+struct stats_snap {
+    int len;
+    char text[STATS_MAX];
+};
+
+static struct stats_snap *stats_snapshot(void)
+{
+    struct stats_snap *snap = malloc(sizeof(*snap));
+    snap->len = stats_text(snap->text, sizeof(snap->text));
+    if (snap->len > STATS_MAX - 1)
+    {
+        snap->len = STATS_MAX - 1;
+    }
+    return snap;
+}
+
+static int stats_open(struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EACCES;
+    }
+    fi->fh = (uintptr_t)stats_snapshot();
+    fi->direct_io = 1;
+    return SUCCESS;
+}
+
+static void stats_release(struct fuse_file_info *fi)
+{
+    if (fi != NULL)
+    {
+        free((void *)(uintptr_t)fi->fh);
+    }
+}
+
+/* the REPL reads without opening, so it gets a snapshot when it reads
+ * from offset 0 and keeps it for the rest of the file
+ */
+static struct stats_snap *repl_snap;
+
+static int stats_read(char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+    struct stats_snap *snap;
+    if (fi != NULL)
+    {
+        snap = (void *)(uintptr_t)fi->fh;
+    }
+    else
+    {
+        if (offset == 0 || repl_snap == NULL)
+        {
+            free(repl_snap);
+            repl_snap = stats_snapshot();
+        }
+        snap = repl_snap;
+    }
+    if (offset >= snap->len)
+    {
+        len = 0;
+    }
+    else if (len > snap->len - offset)
+    {
+        len = snap->len - offset;
+    }
+    memcpy(buf, snap->text + offset, len);
+    return len;
 }
 
 /* operations vector. Please don't rename it, as the skeleton code in
@@ -1471,21 +3624,26 @@ static int fs_statfs(const char *path, struct statvfs *st)
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,
-    .getattr = fs_getattr,
-    .opendir = fs_opendir,
-    .readdir = fs_readdir,
-    .releasedir = fs_releasedir,
-    .mknod = fs_mknod,
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .utime = fs_utime,
-    .truncate = fs_truncate,
-    .open = fs_open,
-    .read = fs_read,
-    .write = fs_write,
-    .release = fs_release,
-    .statfs = fs_statfs,
+    .destroy = fs_destroy,
+    .getattr = fs_getattr_locked,
+    .opendir = fs_opendir_locked,
+    .readdir = fs_readdir_locked,
+    .releasedir = fs_releasedir_locked,
+    .mknod = fs_mknod_locked,
+    .mkdir = fs_mkdir_locked,
+    .unlink = fs_unlink_locked,
+    .rmdir = fs_rmdir_locked,
+    .rename = fs_rename_locked,
+    .chmod = fs_chmod_locked,
+    .utime = fs_utime_locked,
+    .truncate = fs_truncate_locked,
+    .open = fs_open_locked,
+    .read = fs_read_locked,
+    .write = fs_write_locked,
+    .release = fs_release_locked,
+    .flush = fs_flush_locked,
+    .fsync = fs_fsync_locked,
+    .fsyncdir = fs_fsyncdir_locked,
+    .statfs = fs_statfs_locked,
+    .fallocate = fs_fallocate_locked,
 };
@@ -5,7 +5,7 @@
  * Peter Desnoyers, Northeastern Computer Science, 2011
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE             /* sync_file_range, fallocate */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,25 +17,29 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <linux/falloc.h>
 
 #include "blkdev.h"
+#include "probes.h"
 
 struct image_dev {
     char *path;
     int   fd;
-    int   nblks;
+    int64_t nblks;
+    int   no_punch;             /* file system can't punch holes */
 };
 
 
-/* The blkdev operations - num_blocks, read, write, and close.
+/* The blkdev operations - num_blocks, read, write, flush, discard and
+ * close.
  */
-static int image_num_blocks(struct blkdev *dev)
+static int64_t image_num_blocks(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
     return im->nblks;
 }
 
-static int image_read(struct blkdev *dev, int offset, int len, void *buf)
+static int image_read(struct blkdev *dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
@@ -44,8 +48,12 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
         return E_UNAVAIL;
 
     assert(offset >= 0 && offset+len <= im->nblks);
+    PROBE2(image_read, offset, len);
 
-    int result = pread(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    /* byte offsets are computed in off_t - an int overflows at 2GB
+     */
+    ssize_t result = pread(im->fd, buf, (size_t)len*BLOCK_SIZE,
+                           (off_t)offset*BLOCK_SIZE);
 
     /* Since I'm not asking for the code that calls this to handle
      * errors other than E_BADADDR and E_UNAVAIL, we report errors and
@@ -56,7 +64,7 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
         fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*BLOCK_SIZE) {
         fprintf(stderr, "short read on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -64,24 +72,23 @@ static int image_read(struct blkdev *dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
-static int image_write(struct blkdev * dev, int offset, int len, void *buf)
+static int image_write(struct blkdev * dev, int64_t offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
-    if (offset == 0)
-        printf("ERROR? write to sector 0\n");
-    
     /* to fail a disk we close its file descriptor and set it to -1 */
     if (im->fd == -1)
         return E_UNAVAIL;
 
      assert(offset >= 0 && offset+len <= im->nblks);
+    PROBE2(image_write, offset, len);
     
-    int result = pwrite(im->fd, buf, len*BLOCK_SIZE, offset*BLOCK_SIZE);
+    ssize_t result = pwrite(im->fd, buf, (size_t)len*BLOCK_SIZE,
+                            (off_t)offset*BLOCK_SIZE);
 
     /* again, report the error and then exit with an assert
      */
-    if (result != len*BLOCK_SIZE) {
+    if (result != (ssize_t)len*BLOCK_SIZE) {
         fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
         assert(0);
     }
@@ -89,8 +96,59 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
     return SUCCESS;
 }
 
-static int image_flush(struct blkdev * dev, int offset, int len)
+/* flush a range of blocks, or with len=0 the whole image. A range is
+ * only written back from the page cache (sync_file_range); the whole
+ * image gets fdatasync, which also flushes the drive's write cache -
+ * that is the one to use for durability.
+ */
+static int image_flush(struct blkdev * dev, int64_t offset, int len)
 {
+    struct image_dev *im = dev->private;
+    int result;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    if (len > 0) {
+        assert(offset >= 0 && offset+len <= im->nblks);
+        result = sync_file_range(im->fd, (off_t)offset*BLOCK_SIZE, (off_t)len*BLOCK_SIZE,
+                                 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                 SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    else
+        result = fdatasync(im->fd);
+
+    if (result < 0) {
+        fprintf(stderr, "flush error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/* discard punches a hole in the image file, so freed blocks stop
+ * taking up space on the host. If the host file system can't do that,
+ * the blocks are simply left as they are.
+ */
+static int image_discard(struct blkdev * dev, int64_t offset, int len)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+    if (im->no_punch)
+        return SUCCESS;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    if (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)offset*BLOCK_SIZE, (off_t)len*BLOCK_SIZE) < 0) {
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            im->no_punch = 1;
+            return SUCCESS;
+        }
+        fprintf(stderr, "discard error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
     return SUCCESS;
 }
 
@@ -110,6 +168,7 @@ struct blkdev_ops image_ops = {
     .read = image_read,
     .write = image_write,
     .flush = image_flush,
+    .discard = image_discard,
     .close = image_close
 };
 
@@ -124,6 +183,7 @@ struct blkdev *image_create(char *path)
         return NULL;
 
     im->path = strdup(path);    /* save a copy for error reporting */
+    im->no_punch = 0;
     
     im->fd = open(path, O_RDWR);
     if (im->fd < 0) {
@@ -0,0 +1,218 @@
+/*
+ * file:        iostat.c
+ * description: block I/O statistics - see iostat.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "iostat.h"
+
+__thread int io_tag = IO_DATA;
+__thread uint64_t io_blks_read, io_blks_written;
+
+static char *class_names[] = {"super", "bitmap", "inode", "dir", "indir", "data", "journal"};
+
+uint64_t io_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* values below IO_HIST_SUB have a bucket each; above that, the bucket
+ * is picked by the top bit and the IO_HIST_SUB-1 bits after it
+ */
+#define SUB_BITS 5              /* log2(IO_HIST_SUB) */
+
+static int bucket(uint64_t v)
+{
+    if (v < IO_HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    int i = (shift + 1) * IO_HIST_SUB + (v >> shift) - IO_HIST_SUB;
+    return i < IO_HIST_BUCKETS ? i : IO_HIST_BUCKETS - 1;
+}
+
+/* middle of bucket 'i' */
+static uint64_t bucket_value(int i)
+{
+    if (i < IO_HIST_SUB)
+        return i;
+    int shift = i / IO_HIST_SUB - 1;
+    uint64_t low = (uint64_t)(IO_HIST_SUB + i % IO_HIST_SUB) << shift;
+    return low + (1ULL << shift) / 2;
+}
+
+void io_hist_add(struct io_hist *h, uint64_t ns)
+{
+    h->n++;
+    h->sum += ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->counts[bucket(ns)]++;
+}
+
+uint64_t io_hist_quantile(const struct io_hist *h, double q)
+{
+    uint64_t seen = 0, target = q * h->n;
+    int i;
+    if (h->n == 0)
+        return 0;
+    for (i = 0; i < IO_HIST_BUCKETS; i++)
+        if ((seen += h->counts[i]) > target)
+            break;
+    uint64_t v = bucket_value(i < IO_HIST_BUCKETS ? i : IO_HIST_BUCKETS - 1);
+    return v < h->max ? v : h->max;
+}
+
+struct io_counts {
+    uint64_t reqs, blks, seq;
+    struct io_hist lat;
+};
+
+enum {OP_READ, OP_WRITE, OP_FLUSH, OP_DISCARD, N_OPS};
+static char *op_names[] = {"read", "write", "flush", "discard"};
+
+struct iostat {
+    struct blkdev *dev;
+    pthread_mutex_t lock;
+    int64_t head;               /* block after the last read or write */
+    /* flush and discard aren't tagged - they use class 0 */
+    struct io_counts counts[N_OPS][IO_N_CLASSES];
+};
+
+static void count(struct iostat *s, int op, int64_t first_blk, int num_blks, uint64_t t0)
+{
+    uint64_t ns = io_now() - t0;
+    int tag = (op == OP_READ || op == OP_WRITE) ? io_tag : 0;
+    if (tag < 0 || tag >= IO_N_CLASSES)
+        tag = IO_DATA;
+    struct io_counts *c = &s->counts[op][tag];
+
+    pthread_mutex_lock(&s->lock);
+    c->reqs++;
+    c->blks += num_blks;
+    if (op == OP_READ || op == OP_WRITE) {
+        if (first_blk == s->head)
+            c->seq++;
+        s->head = first_blk + num_blks;
+    }
+    io_hist_add(&c->lat, ns);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int64_t iostat_num_blocks(struct blkdev *idev)
+{
+    struct iostat *s = idev->private;
+    return s->dev->ops->num_blocks(s->dev);
+}
+
+static int iostat_read(struct blkdev *idev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct iostat *s = idev->private;
+    uint64_t t0 = io_now();
+    int val = s->dev->ops->read(s->dev, first_blk, num_blks, buf);
+    count(s, OP_READ, first_blk, num_blks, t0);
+    io_blks_read += num_blks;
+    return val;
+}
+
+static int iostat_write(struct blkdev *idev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct iostat *s = idev->private;
+    uint64_t t0 = io_now();
+    int val = s->dev->ops->write(s->dev, first_blk, num_blks, buf);
+    count(s, OP_WRITE, first_blk, num_blks, t0);
+    io_blks_written += num_blks;
+    return val;
+}
+
+static int iostat_flush(struct blkdev *idev, int64_t first_blk, int num_blks)
+{
+    struct iostat *s = idev->private;
+    uint64_t t0 = io_now();
+    int val = s->dev->ops->flush(s->dev, first_blk, num_blks);
+    count(s, OP_FLUSH, first_blk, num_blks, t0);
+    return val;
+}
+
+static int iostat_discard(struct blkdev *idev, int64_t first_blk, int num_blks)
+{
+    struct iostat *s = idev->private;
+    uint64_t t0 = io_now();
+    int val = s->dev->ops->discard(s->dev, first_blk, num_blks);
+    count(s, OP_DISCARD, first_blk, num_blks, t0);
+    return val;
+}
+
+static void iostat_close(struct blkdev *idev)
+{
+    struct iostat *s = idev->private;
+    s->dev->ops->close(s->dev);
+    free(s);
+    free(idev);
+}
+
+struct blkdev_ops iostat_ops = {
+    .num_blocks = iostat_num_blocks,
+    .read = iostat_read,
+    .write = iostat_write,
+    .flush = iostat_flush,
+    .discard = iostat_discard,
+    .close = iostat_close
+};
+
+struct blkdev *iostat_create(struct blkdev *dev)
+{
+    struct blkdev *idev = malloc(sizeof(*idev));
+    struct iostat *s = calloc(1, sizeof(*s));
+
+    if (idev == NULL || s == NULL)
+        return NULL;
+    s->dev = dev;
+    pthread_mutex_init(&s->lock, NULL);
+    s->head = -1;
+    idev->ops = &iostat_ops;
+    idev->private = s;
+    return idev;
+}
+
+/* one line per operation and class with any requests; times in us */
+void iostat_report(struct blkdev *idev, FILE *fp)
+{
+    struct iostat *s = idev->private;
+    int op, tag;
+
+    pthread_mutex_lock(&s->lock);
+    fprintf(fp, "%-8s %-8s %8s %10s %5s %9s %9s %9s %9s %9s\n", "class", "op", "reqs",
+            "KB", "seq%", "avg_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (op = 0; op < N_OPS; op++)
+        for (tag = 0; tag < IO_N_CLASSES; tag++) {
+            struct io_counts *c = &s->counts[op][tag];
+            if (c->reqs == 0)
+                continue;
+            fprintf(fp, "%-8s %-8s %8llu %10llu %5.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                    op <= OP_WRITE ? class_names[tag] : "-", op_names[op],
+                    (unsigned long long)c->reqs,
+                    (unsigned long long)c->blks * BLOCK_SIZE / 1024,
+                    op <= OP_WRITE ? 100.0 * c->seq / c->reqs : 0.0,
+                    c->lat.sum / 1e3 / c->reqs,
+                    io_hist_quantile(&c->lat, 0.5) / 1e3,
+                    io_hist_quantile(&c->lat, 0.99) / 1e3,
+                    io_hist_quantile(&c->lat, 0.999) / 1e3,
+                    c->lat.max / 1e3);
+        }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void iostat_reset(struct blkdev *idev)
+{
+    struct iostat *s = idev->private;
+    pthread_mutex_lock(&s->lock);
+    memset(s->counts, 0, sizeof(s->counts));
+    s->head = -1;
+    pthread_mutex_unlock(&s->lock);
+}
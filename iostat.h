@@ -0,0 +1,50 @@
+/*
+ * file:        iostat.h
+ * description: block I/O statistics, as a blkdev wrapper
+ *
+ * Every request through the device is counted - requests, blocks,
+ * how many were sequential (starting where the one before ended) and
+ * a histogram of how long they took - separately for each operation
+ * and for each class of block. The class is the caller's: each thread
+ * sets 'io_tag' before a read or write, and it applies until changed.
+ * It's safe to call from several threads.
+ */
+#ifndef __IOSTAT_H__
+#define __IOSTAT_H__
+
+#include <stdio.h>
+#include "blkdev.h"
+
+enum io_class {IO_SUPER, IO_BITMAP, IO_INODE, IO_DIR, IO_INDIR, IO_DATA,
+               IO_JOURNAL, IO_N_CLASSES};
+extern __thread int io_tag;
+
+/* blocks this thread has read and written through iostat devices */
+extern __thread uint64_t io_blks_read, io_blks_written;
+
+/* HDR-style latency histogram, in nanoseconds: buckets are powers of
+ * two, each split into IO_HIST_SUB linear sub-buckets, so any value
+ * is recorded to within 1/IO_HIST_SUB (about 3%), up to a few hours.
+ */
+#define IO_HIST_SUB 32
+#define IO_HIST_BUCKETS (40 * IO_HIST_SUB)
+struct io_hist {
+    uint64_t n, sum, max;
+    uint64_t counts[IO_HIST_BUCKETS];
+};
+
+extern void io_hist_add(struct io_hist *h, uint64_t ns);
+
+/* the value below which fraction 'q' of the recorded values lie */
+extern uint64_t io_hist_quantile(const struct io_hist *h, double q);
+
+/* nanoseconds on the monotonic clock */
+extern uint64_t io_now(void);
+
+extern struct blkdev *iostat_create(struct blkdev *dev);
+
+/* print the counts and latencies so far, and/or clear them */
+extern void iostat_report(struct blkdev *idev, FILE *fp);
+extern void iostat_reset(struct blkdev *idev);
+
+#endif
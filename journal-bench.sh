@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# file:        journal-bench.sh
+# description: metadata benchmark - creates empty files in a tree of
+#              directories and reports creates/sec without a journal,
+#              committing every operation, and with group commit
+#
+# usage: journal-bench.sh <mountpoint> [dirs] [files per dir]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [dirs] [files per dir]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1
+dirs=${2:-30}           # ... and so does the root
+files=${3:-30}          # a directory holds at most 32 entries
+disk=/tmp/$USER-jnl.img
+
+for f in ./homework ./mkfs-x6; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+now(){
+    date +%s.%N
+}
+
+run(){
+    name=$1; jnl=$2; shift 2
+    ./mkfs-x6 -size 64m -journal $jnl $disk > /dev/null
+    ./homework "$@" -image $disk $MNT || exit 1
+
+    t0=$(now)
+    bash -c '
+        d=0
+        while [ $d -lt '$dirs' ] ; do
+            mkdir '$MNT'/d$d
+            f=0
+            while [ $f -lt '$files' ] ; do
+                : > '$MNT'/d$d/f$f
+                f=$((f+1))
+            done
+            d=$((d+1))
+        done'
+    unmount
+    t1=$(now)
+
+    echo "$name $t0 $t1" | awk -v n=$((dirs * (files + 1))) '
+        { printf "%-22s %d creates in %.2fs: %.0f creates/sec\n",
+                 $1, n, $3 - $2, n / ($3 - $2) }'
+}
+
+run no-journal 0
+run commit-every-op 1024 -commit 0
+run group-commit 1024
+rm -f $disk
@@ -0,0 +1,365 @@
+/*
+ * file:        journal.c
+ * description: write-ahead metadata journal, as a blkdev wrapper - see
+ *              journal.h
+ *
+ * The journal region holds only the most recent transaction: each
+ * commit writes its record at the start of the region, and the blocks
+ * are written in place straight after, so the next commit can reuse
+ * the space. Replaying that transaction again (e.g. at every mount) is
+ * harmless - a block in it can only have been reused for file data by
+ * freeing it, which commits a newer transaction over it.
+ *
+ * The record is [header][tag blocks][logged blocks], checked by a
+ * crc32 over all of it, so a torn write of the record is ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "journal.h"
+#include "iostat.h"
+
+#define JNL_TAGS_PER_BLK (BLOCK_SIZE / sizeof(uint32_t))
+
+struct journal {
+    struct blkdev *dev;
+    int64_t base;
+    int size;                   /* journal region, in blocks */
+    int max_blocks;             /* most blocks one record can hold */
+    uint64_t seq;
+
+    /* running transaction - entries are never removed, but forgotten
+     * ones have blk[i] = -1. 'hash' maps block numbers to entry + 1.
+     */
+    int n, live;
+    int64_t *blk;
+    int *tag;                   /* io_tag of the last write, for iostat */
+    char *data;
+    int *hash, hash_sz;
+
+    int interval_ms;
+    struct timespec started;    /* when the first block was added */
+};
+
+/* crc32 (IEEE), table driven
+ */
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    if (crc_table[1] == 0) {
+        uint32_t i, j, c;
+        for (i = 0; i < 256; i++) {
+            for (c = i, j = 0; j < 8; j++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int tag_blocks(int n)
+{
+    if (n <= JNL_HDR_TAGS)
+        return 0;
+    return (n - JNL_HDR_TAGS + JNL_TAGS_PER_BLK - 1) / JNL_TAGS_PER_BLK;
+}
+
+static int find(struct journal *j, int64_t blk)
+{
+    int h = (blk * 2654435761u) & (j->hash_sz - 1);
+    for (; j->hash[h]; h = (h + 1) & (j->hash_sz - 1))
+        if (j->blk[j->hash[h] - 1] == blk)
+            return j->hash[h] - 1;
+    return -1;
+}
+
+static void reset(struct journal *j)
+{
+    j->n = j->live = 0;
+    memset(j->hash, 0, j->hash_sz * sizeof(int));
+}
+
+/* block number order, for writing the blocks in place */
+static int64_t *sort_blk;
+static int cmp_entry(const void *a, const void *b)
+{
+    int64_t x = sort_blk[*(int *)a], y = sort_blk[*(int *)b];
+    return x < y ? -1 : x > y;
+}
+
+/* write logged blocks in place, a run of consecutive blocks at a time.
+ * 'blocks' holds 'n' block numbers in increasing order, and 'data'
+ * the blocks themselves in the same order. 'tags', if not NULL, has
+ * the io_tag each block was written with - a run has only one.
+ */
+static int write_home(struct blkdev *dev, uint32_t *blocks, int n, char *data, int *tags)
+{
+    int i, k;
+    for (i = 0; i < n; i = k) {
+        for (k = i + 1; k < n && blocks[k] == blocks[k - 1] + 1 &&
+                 (tags == NULL || tags[k] == tags[i]); k++)
+            ;
+        io_tag = tags ? tags[i] : IO_JOURNAL;
+        if (dev->ops->write(dev, blocks[i], k - i, data + (size_t)i * BLOCK_SIZE) < 0)
+            return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+int journal_commit(struct blkdev *jdev)
+{
+    struct journal *j = jdev->private;
+    struct blkdev *dev = j->dev;
+    int i, k, val, saved_tag = io_tag;
+
+    if (j->live == 0) {
+        reset(j);
+        return SUCCESS;
+    }
+
+    int order[j->live];
+    for (i = k = 0; i < j->n; i++)
+        if (j->blk[i] >= 0)
+            order[k++] = i;
+    sort_blk = j->blk;
+    qsort(order, j->live, sizeof(int), cmp_entry);
+
+    /* build the record: header, tags, blocks */
+    int n = j->live, n_tag = tag_blocks(n);
+    char *rec = calloc(1 + n_tag + n, BLOCK_SIZE);
+    struct jnl_header *hdr = (void *)rec;
+    uint32_t *tags = hdr->blocks;       /* runs on into the tag blocks */
+    char *data = rec + (size_t)(1 + n_tag) * BLOCK_SIZE;
+    int tag[n];
+
+    hdr->magic = JNL_MAGIC;
+    hdr->n_blocks = n;
+    hdr->seq = j->seq;
+    for (i = 0; i < n; i++) {
+        tags[i] = j->blk[order[i]];
+        tag[i] = j->tag[order[i]];
+        memcpy(data + (size_t)i * BLOCK_SIZE, j->data + (size_t)order[i] * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    hdr->checksum = crc32(0, rec, (size_t)(1 + n_tag + n) * BLOCK_SIZE);
+
+    /* file data and the previous transaction's in-place writes must be
+     * on disk before this record, and the record before its blocks
+     */
+    io_tag = IO_JOURNAL;
+    if ((val = dev->ops->flush(dev, 0, 0)) < 0 ||
+        (val = dev->ops->write(dev, j->base, 1 + n_tag + n, rec)) < 0 ||
+        (val = dev->ops->flush(dev, 0, 0)) < 0 ||
+        (val = write_home(dev, tags, n, data, tag)) < 0) {
+        io_tag = saved_tag;
+        free(rec);
+        return val;
+    }
+
+    io_tag = saved_tag;
+    free(rec);
+    j->seq++;
+    reset(j);
+    return SUCCESS;
+}
+
+void journal_forget(struct blkdev *jdev, int64_t blk)
+{
+    struct journal *j = jdev->private;
+    int i = find(j, blk);
+    if (i >= 0) {
+        j->blk[i] = -1;
+        j->live--;
+    }
+}
+
+void journal_set_interval(struct blkdev *jdev, int ms)
+{
+    struct journal *j = jdev->private;
+    j->interval_ms = ms;
+}
+
+void journal_op_done(struct blkdev *jdev)
+{
+    struct journal *j = jdev->private;
+    struct timespec now;
+
+    if (j->live == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - j->started.tv_sec) * 1000 +
+        (now.tv_nsec - j->started.tv_nsec) / 1000000 >= j->interval_ms)
+        journal_commit(jdev);
+}
+
+/* add a block to the running transaction, committing first if it's
+ * full. An operation bigger than the journal is split this way.
+ */
+static int add(struct blkdev *jdev, int64_t blk, const void *buf)
+{
+    struct journal *j = jdev->private;
+    int i = find(j, blk);
+
+    if (i < 0) {
+        if (j->n == j->max_blocks && journal_commit(jdev) < 0)
+            return E_UNAVAIL;
+        i = j->n++;
+        j->blk[i] = blk;
+        int h = (blk * 2654435761u) & (j->hash_sz - 1);
+        while (j->hash[h])
+            h = (h + 1) & (j->hash_sz - 1);
+        j->hash[h] = i + 1;
+        if (j->live++ == 0)
+            clock_gettime(CLOCK_MONOTONIC, &j->started);
+    }
+    j->tag[i] = io_tag;
+    memcpy(j->data + (size_t)i * BLOCK_SIZE, buf, BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/* the blkdev operations
+ */
+static int64_t journal_num_blocks(struct blkdev *jdev)
+{
+    struct journal *j = jdev->private;
+    return j->dev->ops->num_blocks(j->dev);
+}
+
+static int journal_read(struct blkdev *jdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct journal *j = jdev->private;
+    int i, k, val = j->dev->ops->read(j->dev, first_blk, num_blks, buf);
+
+    for (i = 0; val >= 0 && j->live > 0 && i < num_blks; i++)
+        if ((k = find(j, first_blk + i)) >= 0)
+            memcpy((char *)buf + (size_t)i * BLOCK_SIZE, j->data + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+    return val;
+}
+
+static int journal_write(struct blkdev *jdev, int64_t first_blk, int num_blks, void *buf)
+{
+    int i, val;
+    for (i = 0; i < num_blks; i++)
+        if ((val = add(jdev, first_blk + i, (char *)buf + (size_t)i * BLOCK_SIZE)) < 0)
+            return val;
+    return SUCCESS;
+}
+
+/* flushing the journal device means committing - which leaves the
+ * record on stable storage, so everything before it is too. With
+ * nothing to commit, just flush the device.
+ */
+static int journal_flush(struct blkdev *jdev, int64_t first_blk, int num_blks)
+{
+    struct journal *j = jdev->private;
+    if (j->live == 0)
+        return j->dev->ops->flush(j->dev, 0, 0);
+    return journal_commit(jdev);
+}
+
+/* a discarded block has nothing left worth logging */
+static int journal_discard(struct blkdev *jdev, int64_t first_blk, int num_blks)
+{
+    struct journal *j = jdev->private;
+    int i;
+    for (i = 0; i < num_blks; i++)
+        journal_forget(jdev, first_blk + i);
+    return j->dev->ops->discard(j->dev, first_blk, num_blks);
+}
+
+static void journal_close(struct blkdev *jdev)
+{
+    struct journal *j = jdev->private;
+    journal_commit(jdev);
+    j->dev->ops->close(j->dev);
+    free(j->blk);
+    free(j->tag);
+    free(j->data);
+    free(j->hash);
+    free(j);
+    free(jdev);
+}
+
+struct blkdev_ops journal_ops = {
+    .num_blocks = journal_num_blocks,
+    .read = journal_read,
+    .write = journal_write,
+    .flush = journal_flush,
+    .discard = journal_discard,
+    .close = journal_close
+};
+
+/* replay the record in the journal region, if there's a valid one */
+static int replay(struct journal *j)
+{
+    struct blkdev *dev = j->dev;
+    struct jnl_header hdr;
+    int val;
+
+    io_tag = IO_JOURNAL;
+    if (dev->ops->read(dev, j->base, 1, &hdr) < 0)
+        return E_UNAVAIL;
+    if (hdr.magic != JNL_MAGIC || hdr.n_blocks == 0 || hdr.n_blocks > j->max_blocks)
+        return SUCCESS;
+
+    int n = hdr.n_blocks, n_tag = tag_blocks(n);
+    char *rec = malloc((size_t)(1 + n_tag + n) * BLOCK_SIZE);
+    if ((val = dev->ops->read(dev, j->base, 1 + n_tag + n, rec)) < 0) {
+        free(rec);
+        return val;
+    }
+    struct jnl_header *h = (void *)rec;
+    uint32_t sum = h->checksum;
+    h->checksum = 0;
+    if (crc32(0, rec, (size_t)(1 + n_tag + n) * BLOCK_SIZE) == sum) {
+        j->seq = h->seq + 1;
+        val = write_home(dev, h->blocks, n, rec + (size_t)(1 + n_tag) * BLOCK_SIZE, NULL);
+        if (val >= 0)
+            val = dev->ops->flush(dev, 0, 0);
+    }
+    free(rec);
+    return val;
+}
+
+/* create a journal device on top of 'dev', with the journal in blocks
+ * [base, base+nblks), replaying any committed transaction found there.
+ */
+struct blkdev *journal_create(struct blkdev *dev, int64_t base, int nblks)
+{
+    struct blkdev *jdev = malloc(sizeof(*jdev));
+    struct journal *j = calloc(1, sizeof(*j));
+
+    if (jdev == NULL || j == NULL || nblks < 2)
+        return NULL;
+
+    j->dev = dev;
+    j->base = base;
+    j->size = nblks;
+    for (j->max_blocks = nblks - 1;
+         1 + tag_blocks(j->max_blocks) + j->max_blocks > nblks; j->max_blocks--)
+        ;
+    j->blk = malloc(j->max_blocks * sizeof(int64_t));
+    j->tag = malloc(j->max_blocks * sizeof(int));
+    j->data = malloc((size_t)j->max_blocks * BLOCK_SIZE);
+    for (j->hash_sz = 16; j->hash_sz < 2 * j->max_blocks; j->hash_sz *= 2)
+        ;
+    j->hash = calloc(j->hash_sz, sizeof(int));
+    if (j->blk == NULL || j->tag == NULL || j->data == NULL || j->hash == NULL)
+        return NULL;
+
+    jdev->ops = &journal_ops;
+    jdev->private = j;
+
+    if (replay(j) < 0) {
+        fprintf(stderr, "journal replay failed\n");
+        return NULL;
+    }
+    return jdev;
+}
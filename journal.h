@@ -0,0 +1,54 @@
+/*
+ * file:        journal.h
+ * description: write-ahead metadata journal, as a blkdev wrapper
+ *
+ * Writes through the journal device are collected into a running
+ * transaction, and reads see them, but nothing reaches the disk until
+ * the transaction commits: the blocks are written to the journal
+ * region in one sequential write, flushed, and then written in place.
+ * journal_create replays the last committed transaction.
+ *
+ * The caller serializes all calls, and writes file data directly to
+ * the underlying device (before committing the metadata pointing at
+ * it).
+ */
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "blkdev.h"
+
+#define JNL_MAGIC 0x4a4e4c31    /* 'JNL1' */
+
+/* first block of the journal region. Block numbers of the logged
+ * blocks follow in 'blocks', continuing in tag blocks (256 each) if
+ * there are more than JNL_HDR_TAGS, and then the blocks themselves.
+ */
+#define JNL_HDR_TAGS ((BLOCK_SIZE - 24) / sizeof(uint32_t))
+struct jnl_header {
+    uint32_t magic;
+    uint32_t n_blocks;
+    uint64_t seq;
+    uint32_t checksum;          /* crc32 of the whole record, with this 0 */
+    uint32_t pad;
+    uint32_t blocks[JNL_HDR_TAGS];
+};
+
+extern struct blkdev *journal_create(struct blkdev *dev, int64_t base, int nblks);
+
+/* commit the running transaction, if any */
+extern int journal_commit(struct blkdev *jdev);
+
+/* drop a block from the running transaction - for blocks being freed,
+ * which may be reused for file data before the next commit
+ */
+extern void journal_forget(struct blkdev *jdev, int64_t blk);
+
+/* group commit - call journal_op_done at the end of each operation.
+ * With an interval of 0 it commits every time; otherwise only once
+ * the running transaction is that many milliseconds old, and
+ * journal_commit (e.g. from a timer) picks up the rest.
+ */
+extern void journal_set_interval(struct blkdev *jdev, int ms);
+extern void journal_op_done(struct blkdev *jdev);
+
+#endif
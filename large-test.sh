@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# file:        large-test.sh
+# description: large image tests for FUSE file system - a 9GB sparse
+#              image, files over 4GB, and block addresses past 8GB
+#
+
+if [ x$1 = x-v ] ; then
+    verbose=t; shift
+fi
+
+cmd=./homework
+disk=/tmp/$USER-big.img
+src=/tmp/src-$$
+dst=/tmp/dst-$$
+
+for f in $cmd ./mktest; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit
+  fi
+done
+./mktest -big $disk
+
+echo Testing large image
+
+# 17000 bytes - direct and single indirect blocks
+yes 'large image test' | head -1000 > $src
+
+# file.big is all 'B's: read 4.5GB in (the triple indirect range), and
+# from 50 bytes before EOF. Then extend big.dat past 2GB with a hole,
+# write at 3GB and read it back
+big=5368709120
+$cmd -cmdline -image $disk > /tmp/output-$$ <<EOF
+ls-l file.big
+get file.big $dst.b1 4500000000 3000
+get file.big $dst.b2 $((big + 50)) 1000
+put $src big.dat
+get big.dat $dst
+truncate big.dat 2500000000
+put $src big.dat 3000000000
+get big.dat $dst.w1 3000000000 17000
+get big.dat $dst.w2 2600000000 1024
+ls-l big.dat
+EOF
+[ "$verbose" ] && echo wrote /tmp/output-$$
+
+fail=
+# 5GB+100 bytes in 4 real blocks (8 512-byte units)
+set x $(grep '^/file.big' /tmp/output-$$)
+if [ "$4 $5" != "5368709220 8" ] ; then
+    echo "file.big: size/blocks '$4 $5' should be '5368709220 8'"
+    fail=1
+fi
+set x $(grep '^/big.dat' /tmp/output-$$)
+if [ "$4" != "3000017000" ] ; then
+    echo "big.dat: size '$4' should be 3000017000"
+    fail=1
+fi
+if ! cmp $src $dst ; then
+    fail=1
+fi
+
+# reads above 4GB
+head -c 3000 /dev/zero | tr '\0' B > $dst.b
+if ! cmp $dst.b $dst.b1 ; then
+    echo "file.big: wrong data at 4.5GB"
+    fail=1
+fi
+if ! head -c 50 $dst.b | cmp -s - $dst.b2 ; then
+    echo "file.big: wrong data, or not 50 bytes, at EOF"
+    fail=1
+fi
+
+# the write at 3GB, and the hole below it
+if ! cmp $src $dst.w1 ; then
+    echo "big.dat: data written at 3GB doesn't read back"
+    fail=1
+fi
+if ! head -c 1024 /dev/zero | cmp -s - $dst.w2 ; then
+    echo "big.dat: hole at 2.6GB doesn't read as zeros"
+    fail=1
+fi
+
+# first free block is at 8GB, so that's where big.dat's data starts
+head -c 1024 $src > $dst
+if ! dd if=$disk bs=1024 skip=8388608 count=1 2>/dev/null | cmp -s - $dst ; then
+    echo "big.dat: data not found at 8GB offset in image"
+    fail=1
+fi
+
+# image must still be sparse
+set x $(du -k $disk)
+if [ $2 -gt 102400 ] ; then
+    echo "image uses $2 KB on disk - should be sparse"
+    fail=1
+fi
+
+if [ "$fail" ] ; then
+    echo 'Tests may have failed - see above output for details'
+else
+    echo 'Tests passed'
+fi
+rm -f $src $dst $dst.* $disk
+[ "$verbose" ] || rm -f /tmp/output-$$
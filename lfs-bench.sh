@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# file:        lfs-bench.sh
+# description: random-write benchmark - 4KB (page-sized) writes at
+#              random offsets in an existing file, in place and with
+#              -lfs, on a simulated hard disk (-hdd). Reports IOPS
+#              against the modeled disk time, and checks the file
+#              against a copy written alongside.
+#
+# usage: lfs-bench.sh <mountpoint> [file MB] [writes]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [file MB] [writes]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1
+mb=${2:-8}
+writes=${3:-4000}
+disk=/tmp/$USER-lfs.img
+shadow=/tmp/$USER-lfs.shadow
+stats=/tmp/$USER-lfs.stats
+
+for f in ./homework ./mkfs-x6; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+for mode in "" -lfs; do
+    ./mkfs-x6 -size 16m $disk > /dev/null
+    ./homework -image $disk $MNT || exit 1
+    dd if=/dev/urandom of=$shadow bs=1M count=$mb 2>/dev/null
+    cp $shadow $MNT/file
+    unmount
+
+    # the same offsets and data for both modes
+    rm -f $stats
+    ./homework $mode -hdd $stats -image $disk $MNT || exit 1
+    bash -c '
+        RANDOM=1
+        i=0
+        while [ $i -lt '$writes' ] ; do
+            pg=$(( (RANDOM * 32768 + RANDOM) % ('$mb' * 256) ))
+            head -c 4096 /dev/urandom > /tmp/rec.$$
+            dd if=/tmp/rec.$$ of='$shadow' bs=4k seek=$pg conv=notrunc 2>/dev/null
+            dd if=/tmp/rec.$$ of='$MNT'/file bs=4k seek=$pg conv=notrunc 2>/dev/null
+            i=$((i+1))
+        done
+        rm -f /tmp/rec.$$'
+    unmount
+
+    awk -v mode="${mode:-in-place}" -v n=$writes '
+        { printf "%-9s %d random 4KB writes: %d reads %d writes %d seeks, %.1fs modeled, %.0f IOPS\n",
+                 mode, n, $2, $6, $10, $12, n / $12 }' $stats
+
+    # checked outside the timed mount
+    ./homework -image $disk $MNT || exit 1
+    cmp -s $shadow $MNT/file || echo "${mode:-in-place}: FILE CONTENTS DIFFER"
+    unmount
+done
+rm -f $disk $shadow $stats
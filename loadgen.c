@@ -0,0 +1,301 @@
+/*
+ * file:        loadgen.c
+ * description: load generator for a mounted file system - threads
+ *              pick operations from a weighted mix until time runs
+ *              out, and the run reports ops/sec and latency
+ *              percentiles for each kind of operation.
+ *
+ *  usage: loadgen [-t threads] [-d secs] [-mix small=#,stream=#,rand=#,walk=#]
+ *                 [-big MB] <dir>
+ *
+ * The operations (an op is the unit timed):
+ *   small   create a file, write it, stat it and delete it. Sizes are
+ *           those of the mktest files (1000, 2012, 6644 and 276177
+ *           bytes), in turn.
+ *   stream  one 64KB call of a sequential pass over a STREAM_MB file,
+ *           alternately written and read back
+ *   rand    a 4KB read at a random offset in a '-big' MB file
+ *   walk    'ls -lR' of a tree shaped like write-test.sh test 3
+ *           (dir1/dir1.1/dir1.1.1, dir1/dir1.2, dir2/dir2.1), with
+ *           one of each small file in every directory
+ * Each thread works in its own directory under <dir>; the big file
+ * and the tree are shared. The default mix is all four, equally.
+ *
+ * Mount with '-o hard_remove' (loadgen.sh does): close() releases the
+ * file asynchronously, so an unlink right after it can find the file
+ * still open, and FUSE then renames it to a .fuse_hidden name longer
+ * than this file system allows (EINVAL).
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "iostat.h"
+
+enum {SMALL, STREAM, RAND, WALK, N_KINDS};
+static char *kind_names[] = {"small", "stream", "rand", "walk"};
+static int weights[N_KINDS] = {1, 1, 1, 1};
+
+static int small_sizes[] = {1000, 2012, 6 * 1024 + 500, 269 * 1024 + 721};
+#define N_SMALL 4
+#define STREAM_MB 4
+#define CHUNK 65536
+
+static char *dir;
+static int big_mb = 16;
+static uint64_t deadline;
+static char *zeros;
+
+struct worker {
+    pthread_t tid;
+    unsigned seed;
+    char home[256];
+    int n_small;
+    off_t stream_off;           /* position in the stream pass */
+    int stream_reading;
+    int big_fd;
+    struct io_hist lat[N_KINDS];
+    uint64_t bytes[N_KINDS];
+};
+
+static void die(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+static void write_file(const char *path, int size)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, zeros, size) != size)
+        die(path);
+    close(fd);
+}
+
+static uint64_t op_small(struct worker *w)
+{
+    char path[300];
+    struct stat sb;
+    int size = small_sizes[w->n_small % N_SMALL];
+    sprintf(path, "%s/small.%d", w->home, w->n_small++ % 16);
+    write_file(path, size);
+    if (stat(path, &sb) < 0 || unlink(path) < 0)
+        die(path);
+    return size;
+}
+
+static uint64_t op_stream(struct worker *w)
+{
+    char path[300];
+    sprintf(path, "%s/stream", w->home);
+    int fd = open(path, w->stream_reading ? O_RDONLY : O_WRONLY | O_CREAT, 0644);
+    char buf[CHUNK];
+    if (fd < 0)
+        die(path);
+    if (w->stream_reading) {
+        if (pread(fd, buf, CHUNK, w->stream_off) != CHUNK)
+            die(path);
+    }
+    else if (pwrite(fd, zeros, CHUNK, w->stream_off) != CHUNK)
+        die(path);
+    close(fd);
+    if ((w->stream_off += CHUNK) == STREAM_MB << 20) {
+        w->stream_off = 0;
+        w->stream_reading = !w->stream_reading;
+    }
+    return CHUNK;
+}
+
+static uint64_t op_rand(struct worker *w)
+{
+    char buf[4096];
+    off_t off = (off_t)(rand_r(&w->seed) % (big_mb * 256)) * 4096;
+    if (pread(w->big_fd, buf, 4096, off) != 4096)
+        die("pread");
+    return 4096;
+}
+
+static void walk(const char *path)
+{
+    DIR *d = opendir(path);
+    struct dirent *de;
+    struct stat sb;
+    char sub[512];
+    if (d == NULL)
+        die(path);
+    while ((de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        sprintf(sub, "%s/%s", path, de->d_name);
+        if (lstat(sub, &sb) < 0)
+            die(sub);
+        if (S_ISDIR(sb.st_mode))
+            walk(sub);
+    }
+    closedir(d);
+}
+
+static uint64_t op_walk(struct worker *w)
+{
+    char path[300];
+    sprintf(path, "%s/lg.tree", dir);
+    walk(path);
+    return 0;
+}
+
+static uint64_t (*ops[N_KINDS])(struct worker *w) = {op_small, op_stream, op_rand, op_walk};
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    int total = 0, k;
+    for (k = 0; k < N_KINDS; k++)
+        total += weights[k];
+
+    while (io_now() < deadline) {
+        int r = rand_r(&w->seed) % total;
+        for (k = 0; r >= weights[k]; k++)
+            r -= weights[k];
+        uint64_t t0 = io_now();
+        w->bytes[k] += ops[k](w);
+        io_hist_add(&w->lat[k], io_now() - t0);
+    }
+    return NULL;
+}
+
+/* the shared files: the big file, and the tree for 'walk' */
+static void setup(void)
+{
+    char *dirs[] = {"", "/dir1", "/dir1/dir1.1", "/dir1/dir1.1/dir1.1.1", "/dir1/dir1.2",
+                    "/dir2", "/dir2/dir2.1"};
+    char path[512];
+    int i, j;
+
+    sprintf(path, "%s/lg.big", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        die(path);
+    for (i = 0; i < big_mb * (1 << 20) / CHUNK; i++)
+        if (write(fd, zeros, CHUNK) != CHUNK)
+            die(path);
+    close(fd);
+
+    for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        sprintf(path, "%s/lg.tree%s", dir, dirs[i]);
+        if (mkdir(path, 0755) < 0)
+            die(path);
+        for (j = 0; j < N_SMALL; j++) {
+            sprintf(path, "%s/lg.tree%s/file.%d", dir, dirs[i], j);
+            write_file(path, small_sizes[j]);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 4, secs = 10, i, k;
+
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-t"))
+            threads = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-d"))
+            secs = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-big"))
+            big_mb = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-mix")) {
+            char *p;
+            memset(weights, 0, sizeof(weights));
+            for (p = strtok(argv[2], ","); p != NULL; p = strtok(NULL, ",")) {
+                for (k = 0; k < N_KINDS; k++)
+                    if (!strncmp(p, kind_names[k], strlen(kind_names[k])) &&
+                        p[strlen(kind_names[k])] == '=')
+                        break;
+                if (k == N_KINDS) {
+                    printf("unknown operation in mix: %s\n", p);
+                    exit(1);
+                }
+                char *val = strchr(p, '=') + 1, *end;
+                long w = strtol(val, &end, 10);
+                if (end == val || *end != 0 || w < 0 || w > 1000000) {
+                    printf("bad weight in mix: %s\n", p);
+                    exit(1);
+                }
+                weights[k] = w;
+            }
+        }
+        else
+            break;
+        argv += 2;
+        argc -= 2;
+    }
+    for (i = k = 0; k < N_KINDS; k++)
+        i += weights[k];
+    if (i == 0) {
+        printf("the mix must have a weight above 0\n");
+        exit(1);
+    }
+    if (argc != 2 || threads < 1 || big_mb < 1) {
+        printf("usage: loadgen [-t threads] [-d secs] [-mix small=#,stream=#,rand=#,walk=#] "
+               "[-big MB] <dir>\n");
+        exit(1);
+    }
+    dir = argv[1];
+    zeros = calloc(1, CHUNK > small_sizes[N_SMALL - 1] ? CHUNK : small_sizes[N_SMALL - 1]);
+    setup();
+
+    struct worker *w = calloc(threads, sizeof(*w));
+    char path[300];
+    for (i = 0; i < threads; i++) {
+        w[i].seed = i + 1;
+        sprintf(w[i].home, "%s/lg.t%d", dir, i);
+        if (mkdir(w[i].home, 0755) < 0)
+            die(w[i].home);
+        sprintf(path, "%s/lg.big", dir);
+        if ((w[i].big_fd = open(path, O_RDONLY)) < 0)
+            die(path);
+    }
+
+    uint64_t t0 = io_now();
+    deadline = t0 + secs * 1000000000ULL;
+    for (i = 0; i < threads; i++)
+        pthread_create(&w[i].tid, NULL, worker, &w[i]);
+    for (i = 0; i < threads; i++)
+        pthread_join(w[i].tid, NULL);
+    double elapsed = (io_now() - t0) / 1e9;
+
+    /* merge the threads' histograms */
+    printf("%d threads, %.1f s\n", threads, elapsed);
+    printf("%-8s %10s %10s %8s %10s %10s %10s\n", "op", "ops", "ops/s", "MB/s",
+           "p50_us", "p99_us", "p999_us");
+    uint64_t total = 0;
+    for (k = 0; k < N_KINDS; k++) {
+        struct io_hist h = {0};
+        uint64_t bytes = 0;
+        int b;
+        for (i = 0; i < threads; i++) {
+            h.n += w[i].lat[k].n;
+            h.sum += w[i].lat[k].sum;
+            if (w[i].lat[k].max > h.max)
+                h.max = w[i].lat[k].max;
+            for (b = 0; b < IO_HIST_BUCKETS; b++)
+                h.counts[b] += w[i].lat[k].counts[b];
+            bytes += w[i].bytes[k];
+        }
+        if (h.n == 0)
+            continue;
+        total += h.n;
+        printf("%-8s %10llu %10.1f %8.2f %10.1f %10.1f %10.1f\n", kind_names[k],
+               (unsigned long long)h.n, h.n / elapsed, bytes / 1e6 / elapsed,
+               io_hist_quantile(&h, 0.5) / 1e3, io_hist_quantile(&h, 0.99) / 1e3,
+               io_hist_quantile(&h, 0.999) / 1e3);
+    }
+    printf("%-8s %10llu %10.1f\n", "total", (unsigned long long)total, total / elapsed);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# file:        loadgen.sh
+# description: mixed load on a mounted image (see loadgen.c) - each
+#              workload alone and then all of them together, from 1 to
+#              16 threads
+#
+# usage: loadgen.sh <mountpoint> [seconds per run]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [seconds per run]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1
+secs=${2:-5}
+disk=/tmp/$USER-loadgen.img
+
+for f in ./homework ./mkfs-x6 ./loadgen; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      echo "(loadgen is built with 'make loadgen')"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+for mix in small=1 stream=1 rand=1 walk=1 small=1,stream=1,rand=1,walk=1; do
+    for threads in 1 4 16; do
+        echo "$mix, $threads threads:"
+        ./mkfs-x6 -size 128m $disk > /dev/null
+        ./homework -image $disk -o hard_remove $MNT || exit 1
+        ./loadgen -t $threads -d $secs -mix $mix $MNT | tail -n +2
+        unmount
+    done
+done
+rm -f $disk
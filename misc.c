@@ -21,6 +21,9 @@
 #include <sys/types.h>
 #include <fuse.h>
 #include "blkdev.h"
+#include "simdisk.h"
+#include "ramdisk.h"
+#include "iostat.h"
 
 #include "fsx600.h"		/* only for BLOCK_SIZE */
 
@@ -36,21 +39,51 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
-} _data;
+    int   delalloc;
+    int   commit_ms;
+    int   lfs;
+    char *hdd_stats;
+    char *sim_spec;
+    char *sim_stats;
+    int   nodiscard;
+    char *iostat_file;
+    char *trace_file;
+    int   ramdisk;
+    int   hugepages;
+    char *dump_file;
+} _data = {.commit_ms = 1000};
 int homework_part;
+int delalloc;
+int commit_ms;
+int lfs;
+int discard;
+FILE *trace_fp;
 
 static void help(){
     printf("Arguments:\n");
     printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
     printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
     printf(" -part # : Give either 1, 2 or 3 that correlates to the question in the homework being tested. This will set the homework_part global variable, which may be useful for you as your program runs.\n");
+    printf(" -delalloc : Delayed allocation - hold written data in memory and allocate its blocks when the file is flushed or closed\n");
+    printf(" -lfs : Log-structured data - written blocks are appended to a log, with a cleaner reclaiming free segments (implies -delalloc)\n");
+    printf(" -hdd <file> : Charge all disk I/O to a simulated hard disk, and append its totals to <file> at exit\n");
+    printf(" -simdisk <model> : Charge all disk I/O to a simulated disk - hdd, ssd or net, with optional parameters, e.g. ssd:qd=8 (see simdisk.h)\n");
+    printf(" -simstats <file> : With -simdisk, append the simulated disk's totals to <file> at exit\n");
+    printf(" -commit <ms> : Journal commit interval - metadata changes in that time are committed together (default 1000; 0 commits every operation)\n");
+    printf(" -nodiscard : Don't discard freed blocks - by default they are punched out of the image file, a batch a second\n");
+    printf(" -iostat <file> : Append block I/O statistics (see the 'iostat' command) to <file> at exit\n");
+    printf(" -trace <file> : Record every request to the block cache in <file>, for replay-img\n");
+    printf(" -ramdisk : Load the image into memory and run from there - the image file is not changed\n");
+    printf(" -hugepages : Allocate the -ramdisk memory in huge pages\n");
+    printf(" -dump <file> : With -ramdisk, write the disk to <file> (which may be the image) at exit\n");
 }
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img [-part #] directory
+ *  usage: ./homework -image disk.img [-part #] [-delalloc] [-lfs] [-hdd file] [-simdisk model -simstats file] [-commit ms] [-nodiscard] [-iostat file] [-trace file]
+ *                   [-ramdisk [-hugepages] [-dump file]] directory
  *              disk.img  - name of the image file to mount
  *              directory - directory to mount it on
  */
@@ -58,6 +91,18 @@ static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
     {"-cmdline", offsetof(struct data, cmd_mode), 1},
     {"-part %d", offsetof(struct data, part), 0},
+    {"-delalloc", offsetof(struct data, delalloc), 1},
+    {"-commit %d", offsetof(struct data, commit_ms), 0},
+    {"-lfs", offsetof(struct data, lfs), 1},
+    {"-hdd %s", offsetof(struct data, hdd_stats), 0},
+    {"-simdisk %s", offsetof(struct data, sim_spec), 0},
+    {"-simstats %s", offsetof(struct data, sim_stats), 0},
+    {"-nodiscard", offsetof(struct data, nodiscard), 1},
+    {"-iostat %s", offsetof(struct data, iostat_file), 0},
+    {"-trace %s", offsetof(struct data, trace_file), 0},
+    {"-ramdisk", offsetof(struct data, ramdisk), 1},
+    {"-hugepages", offsetof(struct data, hugepages), 1},
+    {"-dump %s", offsetof(struct data, dump_file), 0},
     FUSE_OPT_END
 };
 
@@ -183,7 +228,8 @@ static int dashl_filler(void *buf, const char *name, const struct stat *sb, off_
 {
     char mode[16];
     sprintf(lsbuf[lsi++], "%s %s %lld %lld %s",
-            name, strmode(mode, sb->st_mode), sb->st_size, sb->st_blocks,
+            name, strmode(mode, sb->st_mode), (long long)sb->st_size,
+            (long long)sb->st_blocks,
             ctime(&sb->st_mtime));
     return 0;
 }
@@ -255,18 +301,20 @@ int do_rm(char *argv[])
 int blksiz;
 char *blkbuf;
 
-int do_put(char *argv[])
+/* copy a file in, starting at 'offset'. With 'create' the file must
+ * not exist yet; otherwise it must.
+ */
+static int put_at(char *outside, char *inside, off_t offset, int create)
 {
-    char *outside = argv[0], *inside = argv[1];
     char path[128];
-    int len, fd, offset = 0, val;
+    int len, fd, val = 0;
 
     if ((fd = open(outside, O_RDONLY, 0)) < 0)
 	return fd;
 
     sprintf(path, "%s/%s", cwd, inside);
     fix_path(path);
-    if ((val = fs_ops.mknod(path, 0777 | S_IFREG, 0)) != 0)
+    if (create && (val = fs_ops.mknod(path, 0777 | S_IFREG, 0)) != 0)
 	return val;
     
     while ((len = read(fd, blkbuf, blksiz)) > 0) {
@@ -276,38 +324,62 @@ int do_put(char *argv[])
 	offset += len;
     }
     close(fd);
+    if (val >= 0 && fs_ops.flush)
+	val = fs_ops.flush(path, NULL);
     return (val >= 0) ? 0 : val;
 }
 
+int do_put(char *argv[])
+{
+    return put_at(argv[0], argv[1], 0, 1);
+}
+
+int do_put3(char *argv[])
+{
+    return put_at(argv[0], argv[1], strtoll(argv[2], NULL, 0), 0);
+}
+
 int do_put1(char *argv[])
 {
     char *args2[] = {argv[0], argv[0]};
     return do_put(args2);
 }
 
-int do_get(char *argv[])
+/* copy up to 'count' bytes out, starting at 'offset'
+ */
+static int get_at(char *inside, char *outside, off_t offset, off_t count)
 {
-    char *inside = argv[0], *outside = argv[1];
     char path[128];
-    int len, fd, offset = 0;
+    int len = 0, fd;
 
     if ((fd = open(outside, O_WRONLY|O_CREAT|O_TRUNC, 0777)) < 0)
 	return fd;
 
     sprintf(path, "%s/%s", cwd, inside);
     fix_path(path);
-    while (1) {
-        len = fs_ops.read(path, blkbuf, blksiz, offset, NULL);
+    while (count > 0) {
+        len = fs_ops.read(path, blkbuf, blksiz < count ? blksiz : count, offset, NULL);
 	if (len > 0)
 	    len = write(fd, blkbuf, len);
         if (len <= 0)
 	    break;
 	offset += len;
+	count -= len;
     }
     close(fd);
     return (len >= 0) ? 0 : len;
 }
 
+int do_get(char *argv[])
+{
+    return get_at(argv[0], argv[1], 0, INT64_MAX);
+}
+
+int do_get4(char *argv[])
+{
+    return get_at(argv[0], argv[1], strtoll(argv[2], NULL, 0), strtoll(argv[3], NULL, 0));
+}
+
 int do_get1(char *argv[])
 {
     char *args2[] = {argv[0], argv[0]};
@@ -318,7 +390,8 @@ int do_show(char *argv[])
 {
     char *file = argv[0];
     char path[128];
-    int len, offset = 0;
+    int len;
+    off_t offset = 0;
 
     sprintf(path, "%s/%s", cwd, file);
     fix_path(path);
@@ -362,6 +435,13 @@ static int do_truncate(char *argv[])
     return fs_ops.truncate(fix_path(path), 0);
 }
 
+static int do_truncate2(char *argv[])
+{
+    char path[128];
+    sprintf(path, "%s/%s", cwd, argv[0]);
+    return fs_ops.truncate(fix_path(path), strtoll(argv[1], NULL, 0));
+}
+
 static int do_utime(char *argv[])
 {
     struct utimbuf ut;
@@ -372,6 +452,23 @@ static int do_utime(char *argv[])
     return fs_ops.utime(fix_path(path), &ut);
 }
     
+/* block I/O statistics, collected just above the image */
+static struct blkdev *io_stats;
+
+static int do_iostat(char *argv[])
+{
+    iostat_report(io_stats, stdout);
+    return 0;
+}
+
+static int do_iostat1(char *argv[])
+{
+    if (strcmp(argv[0], "reset"))
+        return -EINVAL;
+    iostat_reset(io_stats);
+    return 0;
+}
+
 struct {
     char *name;
     int   nargs;
@@ -391,13 +488,18 @@ struct {
     {"rm", 1, do_rm, "rm <file> - remove file"},
     {"put", 2, do_put, "put <outside> <inside> - copy a file from localdir into file system"},
     {"put", 1, do_put1, "put <name> - ditto, but keep the same name"},
+    {"put", 3, do_put3, "put <outside> <inside> <offset> - write into an existing file at <offset>"},
     {"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
     {"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
+    {"get", 4, do_get4, "get <inside> <outside> <offset> <len> - retrieve <len> bytes from <offset>"},
     {"show", 1, do_show, "show <file> - retrieve and print a file"},
     {"statfs", 0, do_statfs, "statfs - print file system info"},
     {"blksiz", 1, do_blksiz, "blksiz - set read/write block size"},
     {"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
+    {"truncate", 2, do_truncate2, "truncate <file> <len> - truncate or extend to <len> bytes"},
     {"utime", 1, do_utime, "utime <file> - set modified time to current time"},
+    {"iostat", 0, do_iostat, "iostat - print block I/O counts and latencies by class"},
+    {"iostat", 1, do_iostat1, "iostat reset - clear them"},
     {0, 0, 0}
 };
 
@@ -487,22 +589,79 @@ int main(int argc, char **argv)
         help();
         exit(1);
     }
-    if ((disk = image_create(file)) == NULL) {
+    if (_data.dump_file != NULL && !_data.ramdisk) {
+        printf("-dump needs -ramdisk\n");
+        help();
+        exit(1);
+    }
+    if (_data.ramdisk)
+        disk = ramdisk_create(file, 0, _data.dump_file, _data.hugepages);
+    else
+        disk = image_create(file);
+    if (disk == NULL) {
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         help();
         exit(1);
     }
+    disk = io_stats = iostat_create(disk);
+
+    /* open the stats files now - fuse_main changes directory to / */
+    FILE *io_fp = NULL;
+    if (_data.iostat_file != NULL && (io_fp = fopen(_data.iostat_file, "a")) == NULL) {
+        printf("cannot open '%s': %s\n", _data.iostat_file, strerror(errno));
+        exit(1);
+    }
+    if (_data.trace_file != NULL && (trace_fp = fopen(_data.trace_file, "w")) == NULL) {
+        printf("cannot open '%s': %s\n", _data.trace_file, strerror(errno));
+        exit(1);
+    }
+    struct blkdev *sim = NULL;
+    FILE *sim_fp = NULL;
+    if (_data.hdd_stats != NULL) {      /* -hdd is short for -simdisk hdd */
+        _data.sim_stats = _data.hdd_stats;
+        if (_data.sim_spec == NULL)
+            _data.sim_spec = "hdd";
+    }
+    if (_data.sim_spec != NULL) {
+        if (_data.sim_stats == NULL) {
+            printf("-simdisk needs -simstats <file>\n");
+            help();
+            exit(1);
+        }
+        if ((sim_fp = fopen(_data.sim_stats, "a")) == NULL) {
+            printf("cannot open '%s': %s\n", _data.sim_stats, strerror(errno));
+            exit(1);
+        }
+        if ((disk = sim = simdisk_create(disk, _data.sim_spec)) == NULL)
+            exit(1);
+    }
 
     homework_part = _data.part;
+    lfs = _data.lfs;
+    delalloc = _data.delalloc || lfs;
+    commit_ms = _data.commit_ms;
+    discard = !_data.nodiscard;
 
+    int val = 0;
     if (_data.cmd_mode) {
         fs_ops.init(NULL);
         _blksiz(1000);
         cmdloop();
-        return 0;
+        fs_ops.destroy(NULL);
     }
+    else
+        val = fuse_main(args.argc, args.argv, &fs_ops, NULL);
 
-    return fuse_main(args.argc, args.argv, &fs_ops, NULL);
+    if (sim != NULL) {
+        simdisk_report(sim, sim_fp);
+        fclose(sim_fp);
+    }
+    if (io_fp != NULL) {
+        iostat_report(io_stats, io_fp);
+        fclose(io_fp);
+    }
+    disk->ops->close(disk);
+    return val;
 }
 
 
@@ -15,31 +15,66 @@
 #include <sys/stat.h>
 
 #include "fsx600.h"
+#include "bitmap.h"
 
-char *disk;
-
-/* handle K/M
+/* handle K/M/G
  */
-int parseint(char *s)
+long long parseint(char *s)
 {
-    int n = strtol(s, &s, 0);
+    long long n = strtoll(s, &s, 0);
     if (tolower(*s) == 'k')
         return n * 1024;
     if (tolower(*s) == 'm')
         return n * 1024 * 1024;
+    if (tolower(*s) == 'g')
+        return n * 1024 * 1024 * 1024;
     return n;
 }
 
 #define DIV_ROUND_UP(n, m) ((n) + (m) - 1) / (m)
 
-/* usage: mkfs-x6 [-size #] file.img
- * If file doesn't exist, create with size '#' (K and M suffixes allowed)
+/* write 'n' blocks at block 'blk', or zeros if 'buf' is NULL */
+static void put_blks(int fd, int blk, int n, void *buf)
+{
+    static char zeros[256 * FS_BLOCK_SIZE];
+    while (n > 0) {
+        int len = buf != NULL || n < 256 ? n : 256;
+        ssize_t bytes = (ssize_t)len * FS_BLOCK_SIZE;
+        if (pwrite(fd, buf ? buf : zeros, bytes, (off_t)blk * FS_BLOCK_SIZE) != bytes) {
+            perror("can't write image");
+            exit(1);
+        }
+        blk += len;
+        n -= len;
+    }
+}
+
+/* usage: mkfs-x6 [-size #] [-journal #] [-lazy_itable_init 0|1] file.img
+ * If file doesn't exist, create with size '#' (K, M and G suffixes allowed)
+ * The journal size is in blocks - by default 1/64 of the image, at
+ * least 64 and at most 4096. '-journal 0' leaves it out.
+ *
+ * The image is created sparse, and only the superblock, bitmaps, the
+ * first inode block and the root directory are written - the rest of
+ * the inode table and the journal are holes, which read as zeros, and
+ * homework never reads inode blocks with no allocated inodes anyway.
+ * '-lazy_itable_init 0' writes the zeros out, for an image whose
+ * metadata should be allocated up front.
  */
 int main(int argc, char **argv)
 {
-    int i, fd = -1, size = 0;
-    if (!strcmp(argv[1], "-size") && argc >= 3) {
-        size = parseint(argv[2]);
+    int fd = -1;
+    long long size = 0;
+    int n_jnl_blks = -1, lazy_itable_init = 1;
+    while (argc >= 3 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-size"))
+            size = parseint(argv[2]);
+        else if (!strcmp(argv[1], "-journal"))
+            n_jnl_blks = parseint(argv[2]);
+        else if (!strcmp(argv[1], "-lazy_itable_init"))
+            lazy_itable_init = atoi(argv[2]);
+        else
+            break;
         argv += 2;
         argc -= 2;
     }
@@ -53,12 +88,12 @@ int main(int argc, char **argv)
         }
     }
     if (fd < 0) {
-        printf("usage: mkfs-x6 [-size #] file.img\n");
+        printf("usage: mkfs-x6 [-size #] [-journal #] [-lazy_itable_init 0|1] file.img\n");
         exit(1);
     }
 
     if (size % FS_BLOCK_SIZE != 0)
-        printf("WARNING: disk size not a multiple of block size: %d (0x%x)\n",
+        printf("WARNING: disk size not a multiple of block size: %lld (0x%llx)\n",
                size, size);
     int n_blks = size / FS_BLOCK_SIZE;
     int n_map_blks = DIV_ROUND_UP(n_blks, 8*FS_BLOCK_SIZE);
@@ -67,38 +102,47 @@ int main(int argc, char **argv)
     int n_ino_blks = DIV_ROUND_UP(n_inos*sizeof(struct fs_inode),
                                   FS_BLOCK_SIZE);
 
-    disk = malloc(n_blks * FS_BLOCK_SIZE);
-    memset(disk, 0, n_blks * FS_BLOCK_SIZE);
-
-    struct fs_super *sb = (void*)disk;
-
     int inode_map_base = 1;
-    fd_set *inode_map = (void*)(disk + inode_map_base*FS_BLOCK_SIZE);
-
     int block_map_base = inode_map_base + n_ino_map_blks;
-    fd_set *block_map = (void*)(disk + block_map_base*FS_BLOCK_SIZE);
-    
     int inode_base = block_map_base + n_map_blks;
-    struct fs_inode *inodes = (void*)(disk + inode_base*FS_BLOCK_SIZE);
+    int journal_base = inode_base + n_ino_blks;
+    if (n_jnl_blks < 0) {
+        n_jnl_blks = n_blks / 64;
+        n_jnl_blks = n_jnl_blks < 64 ? 64 : n_jnl_blks > 4096 ? 4096 : n_jnl_blks;
+    }
+    int rootdir_base = journal_base + n_jnl_blks;
 
-    int rootdir_base = inode_base + n_ino_blks;
-    struct fs_dirent *de = (void*)(disk + rootdir_base*FS_BLOCK_SIZE);
+    /* only the blocks written are built in memory - superblock and
+     * bitmaps, the first inode block, and the root directory
+     */
+    int n_meta_blks = rootdir_base + 1;
+    char *head = calloc(inode_base, FS_BLOCK_SIZE);
+    struct fs_inode *inodes = calloc(1, FS_BLOCK_SIZE);
+    struct fs_dirent *de = calloc(1, FS_BLOCK_SIZE);
+
+    struct fs_super *sb = (void*)head;
+    fd_set *inode_map = (void*)(head + inode_map_base*FS_BLOCK_SIZE);
+    fd_set *block_map = (void*)(head + block_map_base*FS_BLOCK_SIZE);
 
     /* superblock */
     *sb = (struct fs_super){.magic = FS_MAGIC, .inode_map_sz = n_ino_map_blks,
                             .inode_region_sz = n_ino_blks,
                             .block_map_sz = n_map_blks,
-                            .num_blocks = n_blks, .root_inode = 1};
+                            .num_blocks = n_blks, .root_inode = 1,
+                            .free_blocks = n_blks - n_meta_blks,
+                            .free_inodes = n_ino_blks * INODES_PER_BLK - 2,
+                            .journal_base = n_jnl_blks ? journal_base : 0,
+                            .journal_sz = n_jnl_blks, .state = FS_CLEAN};
 
     /* bitmaps */
     FD_SET(0, inode_map);
     FD_SET(1, inode_map);
-    for (i = 0; i <= rootdir_base; i++)
-        FD_SET(i, block_map);
+    bitmap_set_range(block_map, 0, rootdir_base + 1);
 
     int t  = time(NULL);
     inodes[1] = (struct fs_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
                                   .ctime = t, .mtime = t, .size = 1024,
+                                  .blocks = 1,
                                   .direct = {rootdir_base, 0, 0, 0, 0, 0},
                                   .indir_1 = 0, .indir_2 = 0};
 
@@ -110,12 +154,21 @@ int main(int argc, char **argv)
      *       1 - inode map
      *       2 - block map
      *       3,4,5,6 - inodes
-     *       7 - root directory (inode 1)
+     *       7..70 - journal (zero - no transaction)
+     *       71 - root directory (inode 1)
      */
                       
 
-    assert(size == n_blks* FS_BLOCK_SIZE);
-    write(fd, disk, size);
+    assert(size == (long long)n_blks * FS_BLOCK_SIZE);
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+        perror("can't write image");
+        exit(1);
+    }
+    put_blks(fd, 0, inode_base, head);
+    put_blks(fd, inode_base, 1, inodes);
+    put_blks(fd, rootdir_base, 1, de);
+    if (!lazy_itable_init)
+        put_blks(fd, inode_base + 1, rootdir_base - inode_base - 1, NULL);
     close(fd);
 
     return 0;
@@ -10,6 +10,7 @@
 #include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/types.h>
 
 #include "fsx600.h"
 
@@ -18,11 +19,94 @@ fd_set *inode_map;
 fd_set *block_map;
 void *next_ptr;
 
+/* "-big" test image: 9GB, created sparsely. Blocks below 8GB are marked
+ * in use, so anything the file system allocates lands past the 8GB
+ * mark, and /file.big is a 5GB file reaching into the triple indirect
+ * range. To keep the image small every pointer in file.big aliases
+ * the same few blocks (fine for a read-only test file). The image is
+ * marked clean, or the mount-time check would free the unused blocks.
+ */
+static void mkbig(char *file)
+{
+    int i;
+    int n_blks = 9 * 1024 * 1024;
+    int n_map_blks = n_blks / (8 * FS_BLOCK_SIZE);
+    int n_ino_blks = 64 * sizeof(struct fs_inode) / FS_BLOCK_SIZE;
+    int root_blk = 1 + 1 + n_map_blks + n_ino_blks;
+    int n_meta = root_blk + 1;
+
+    disk = calloc(n_meta, FS_BLOCK_SIZE);
+    struct fs_super *sb = (void*)disk;
+    inode_map = (void*)(disk + FS_BLOCK_SIZE);
+    block_map = (void*)(disk + 2*FS_BLOCK_SIZE);
+    struct fs_inode *inodes = (void*)(disk + (2 + n_map_blks)*FS_BLOCK_SIZE);
+    struct fs_dirent *root_de = (void*)(disk + root_blk*FS_BLOCK_SIZE);
+
+    /* everything below 8GB is in use
+     */
+    int first_free = 8 * 1024 * 1024;
+
+    *sb = (struct fs_super){.magic = FS_MAGIC, .inode_map_sz = 1,
+                            .inode_region_sz = n_ino_blks,
+                            .block_map_sz = n_map_blks,
+                            .num_blocks = n_blks, .root_inode = 1,
+                            .free_blocks = n_blks - first_free,
+                            .free_inodes = n_ino_blks * INODES_PER_BLK - 3,
+                            .state = FS_CLEAN};
+    memset(block_map, 0xFF, first_free / 8);
+
+    int t = 0x50000000;
+    inodes[1] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0040777,
+                                  .ctime = t, .mtime = t, .size = 1024,
+                                  .blocks = 1,
+                                  .direct = {root_blk, 0, 0, 0, 0, 0}};
+
+    /* /file.big - data block D, indirect blocks L1, L2, L3 just below 8GB
+     */
+    int D = first_free - 1, L1 = D - 1, L2 = D - 2, L3 = D - 3;
+    int ptrs[3][FS_BLOCK_SIZE / sizeof(int)];
+    char data[FS_BLOCK_SIZE];
+    memset(data, 'B', sizeof(data));
+    for (i = 0; i < FS_BLOCK_SIZE / sizeof(int); i++) {
+        ptrs[0][i] = D;
+        ptrs[1][i] = L1;
+        ptrs[2][i] = L2;
+    }
+    root_de[0] = (struct fs_dirent){.valid = 1, .isDir = 0,
+                                    .inode = 2, .name = "file.big"};
+    inodes[2] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777,
+                                  .ctime = t, .mtime = t,
+                                  .size = 5LL * 1024 * 1024 * 1024 + 100,
+                                  .blocks = 4,
+                                  .direct = {D, D, D, D, D, D},
+                                  .indir_1 = L1, .indir_2 = L2, .indir_3 = L3};
+    FD_SET(0, inode_map);
+    FD_SET(1, inode_map);
+    FD_SET(2, inode_map);
+
+    int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0777);
+    if (fd < 0 || ftruncate(fd, (off_t)n_blks * FS_BLOCK_SIZE) < 0)
+        perror("can't create image"), exit(1);
+    write(fd, disk, n_meta * FS_BLOCK_SIZE);
+    pwrite(fd, data, FS_BLOCK_SIZE, (off_t)D * FS_BLOCK_SIZE);
+    pwrite(fd, ptrs[0], FS_BLOCK_SIZE, (off_t)L1 * FS_BLOCK_SIZE);
+    pwrite(fd, ptrs[1], FS_BLOCK_SIZE, (off_t)L2 * FS_BLOCK_SIZE);
+    pwrite(fd, ptrs[2], FS_BLOCK_SIZE, (off_t)L3 * FS_BLOCK_SIZE);
+    close(fd);
+}
+
+/* usage: mktest [-big] file.img
+ */
 int main(int argc, char **argv)
 {
     int i;
     char *file = argv[1];
 
+    if (argc == 3 && !strcmp(argv[1], "-big")) {
+        mkbig(argv[2]);
+        return 0;
+    }
+
     int n_blks = 1024;
     int n_map_blks = 1;
     int n_inos = 64;
@@ -67,7 +151,7 @@ int main(int argc, char **argv)
     int t = 0x50000000;
     inodes[root_inum] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0040777, 
                                           .ctime = t, .mtime = t,
-                                          .size = 1024,
+                                          .size = 1024, .blocks = 1,
                                           .direct = {root_blk, 0, 0, 0, 0, 0},
                                           .indir_1 = 0, .indir_2 = 0};
 
@@ -86,7 +170,7 @@ int main(int argc, char **argv)
     memset(f1_ptr, 'A', 1000);
     inodes[f1_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+200, .mtime = t+200,
-                                         .size = 1000,
+                                         .size = 1000, .blocks = 1,
                                          .direct = {f1_blk, 0, 0, 0, 0, 0},
                                          .indir_1 = 0, .indir_2 = 0};
     /* "/dir1/", directory, permission 755
@@ -102,7 +186,7 @@ int main(int argc, char **argv)
     
     inodes[d1_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0040755, 
                                          .ctime = t+400, .mtime = t+400,
-                                         .size = 0,
+                                         .size = 0, .blocks = 1,
                                          .direct = {d1_blk, 0, 0, 0, 0, 0},
                                          .indir_1 = 0, .indir_2 = 0};
 
@@ -119,7 +203,7 @@ int main(int argc, char **argv)
     memset(f2_ptr, '2', 2 * FS_BLOCK_SIZE);
     inodes[f2_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+200, .mtime = t+200,
-                                         .size = 2012,
+                                         .size = 2012, .blocks = 2,
                                          .direct = {f2_blk2, f2_blk1, 0, 0, 0, 0},
                                          .indir_1 = 0, .indir_2 = 0};
 
@@ -146,7 +230,7 @@ int main(int argc, char **argv)
                                     .inode = f4_inode, .name = "file.7"};
     inodes[f4_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+300, .mtime = t+300,
-                                         .size = 6*1024 + 500,
+                                         .size = 6*1024 + 500, .blocks = 8,
                                          .direct = {0, 0, 0, 0, 0, 0},
                                          .indir_1 = f4_indirN, .indir_2 = 0};
     for (i = 0; i < 6; i++)
@@ -173,6 +257,7 @@ int main(int argc, char **argv)
     inodes[f5_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                              .ctime = t+300, .mtime = t+300,
                                              .size = 269*1024 + 721,
+                                             .blocks = 273,
                                              .direct = {0, 0, 0, 0, 0, 0},
                                              .indir_1 = 0, .indir_2 = 0};
     for (i = 0; i < 6; i++)
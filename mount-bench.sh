@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# file:        mount-bench.sh
+# description: mount time benchmark - time from starting homework to
+#              the first request being answered, after a clean unmount
+#              and after a crash (which runs the consistency check), on
+#              images of increasing size
+#
+# usage: mount-bench.sh <mountpoint> [sizes...]
+#
+
+if [ "x$1" = "x" ]; then
+  echo "$0 <dir> [sizes...]"
+  echo "Give an empty directory <dir> to mount the test image on"
+  exit 1
+fi
+
+MNT=$1; shift
+sizes=${*:-256m 1g 4g}
+disk=/tmp/$USER-mount.img
+
+for f in ./homework ./mkfs-x6; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit 1
+  fi
+done
+
+unmount(){
+    fusermount -u $MNT 2>/dev/null || umount $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+}
+
+now(){
+    date +%s.%N
+}
+
+# mount and wait for the first getattr to be answered
+timed_mount(){
+    t0=$(now)
+    ./homework -image $disk $MNT || exit 1
+    stat $MNT > /dev/null
+    t1=$(now)
+    echo "$t0 $t1" | awk '{printf "%.3f", $2 - $1}'
+}
+
+for size in $sizes; do
+    ./mkfs-x6 -size $size $disk > /dev/null
+    ./homework -image $disk $MNT || exit 1
+    i=0
+    while [ $i -lt 20 ] ; do
+        mkdir $MNT/d$i
+        dd if=/dev/urandom of=$MNT/d$i/file bs=64k count=16 2>/dev/null
+        i=$((i+1))
+    done
+    unmount
+
+    clean=$(timed_mount)
+    unmount
+
+    ./homework -image $disk $MNT || exit 1
+    pkill -9 -x homework
+    umount -l $MNT 2>/dev/null || fusermount -uz $MNT
+    while pgrep -x homework > /dev/null; do sleep 0.1; done
+    dirty=$(timed_mount)
+    unmount
+
+    echo "$size: mount ${clean}s clean, ${dirty}s after a crash"
+done
+rm -f $disk
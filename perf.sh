@@ -0,0 +1,174 @@
+#!/bin/sh
+#
+# file:        perf.sh
+# description: benchmark regression check - runs bench (see bench.c) on
+#              an image in RAM and compares the results with a baseline,
+#              failing if any metric is outside its tolerance band
+#
+# usage: perf.sh [-update] [baseline.json]
+#     -update   save this run as the new baseline, keeping its tolerances
+#
+# The baseline is bench's JSON output plus a "tolerance" line giving,
+# for each metric, the fraction it may get worse by - e.g. p50_us 0.35
+# fails at 35% slower, ops_per_sec 0.5 at half the throughput - and
+# slack_us is how much any latency may grow regardless, as sub-
+# microsecond ones jitter by more than any sensible percentage. The
+# numbers only mean something on the machine that made the baseline,
+# so regenerate it (make perf-baseline) when you move.
+#
+# bench runs PERF_RUNS times (default 3) and each metric is the median
+# of the runs; a single run swings a lot with whatever else the machine
+# is doing. PERF_N is bench's -n.
+#
+
+if [ x$1 = x-update ] ; then
+    update=t; shift
+fi
+baseline=${1:-perf-baseline.json}
+n=${PERF_N:-20000}
+runs=${PERF_RUNS:-3}
+
+for f in ./bench ./mkfs-x6; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      echo "(bench is built with 'make bench')"
+      exit 1
+  fi
+done
+if [ ! "$update" -a ! -f $baseline ] ; then
+    echo "no baseline $baseline - make one with 'perf.sh -update'"
+    exit 1
+fi
+
+# bench runs on a copy in memory (-ramdisk), so the page cache and
+# fsync stay out of it
+disk=/tmp/$USER-perf-$$.img
+out=/tmp/perf-$$
+
+i=1
+while [ $i -le $runs ]; do
+    ./mkfs-x6 -size 64m $disk > /dev/null
+    if ! ./bench -ramdisk -n $n -o $out.$i $disk > /dev/null 2>&1 ; then
+        echo "bench failed"
+        rm -f $disk $out.*
+        exit 1
+    fi
+    i=$((i+1))
+done
+rm -f $disk
+
+# bench writes one result per line: pick fields out by name
+fields='
+function field(line, key,    m) {
+    if (match(line, "\"" key "\": *[^,}]*") == 0)
+        return ""
+    m = substr(line, RSTART, RLENGTH)
+    sub(/^[^:]*: */, "", m)
+    gsub(/"/, "", m)
+    return m
+}
+BEGIN {
+    n_metrics = split("ops_per_sec mb_per_sec p50_us p99_us", metrics)
+    higher["ops_per_sec"] = higher["mb_per_sec"] = 1
+}'
+
+# the median of the runs, in bench's format
+awk "$fields"'
+function median(name, m,    i, j, v, a) {
+    for (i = 1; i <= n_runs[name]; i++) {
+        v = vals[name, m, i]
+        for (j = i - 1; j > 0 && a[j] > v; j--)
+            a[j + 1] = a[j]
+        a[j + 1] = v
+    }
+    return a[int((n_runs[name] + 1) / 2)]
+}
+NR == 1 { header = $0 }
+/"name"/ {
+    name = field($0, "name")
+    if (!(name in n_runs)) {
+        names[++n_names] = name
+        ops[name] = field($0, "ops")
+        secs[name] = field($0, "secs")
+    }
+    k = ++n_runs[name]
+    for (i = 1; i <= n_metrics; i++)
+        vals[name, metrics[i], k] = field($0, metrics[i]) + 0
+}
+END {
+    print header
+    print " \"results\": ["
+    for (j = 1; j <= n_names; j++) {
+        name = names[j]
+        printf "    {\"name\": \"%s\", \"ops\": %s, \"secs\": %s, \"ops_per_sec\": %.1f, " \
+            "\"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f}%s\n", name, ops[name],
+            secs[name], median(name, "ops_per_sec"), median(name, "mb_per_sec"),
+            median(name, "p50_us"), median(name, "p99_us"), j < n_names ? "," : ""
+    }
+    print "]}"
+}' $out.* > $out
+rm -f $out.*
+
+tolerance='"tolerance": {"ops_per_sec": 0.5, "mb_per_sec": 0.5, "p50_us": 0.35, "p99_us": 3.0, "slack_us": 0.25},'
+if [ "$update" ] ; then
+    [ -f $baseline ] && tolerance=$(grep '"tolerance"' $baseline | sed 's/^ *//')
+    sed "1a\\
+ $tolerance" $out > $baseline
+    rm -f $out
+    echo "wrote $baseline"
+    exit 0
+fi
+
+awk "$fields"'
+FNR == NR && /"tolerance"/ {
+    for (i = 1; i <= n_metrics; i++)
+        tol[metrics[i]] = field($0, metrics[i])
+    slack = field($0, "slack_us") + 0
+    next
+}
+FNR == NR && /"name"/ {
+    name = field($0, "name")
+    names[++n_names] = name
+    for (i = 1; i <= n_metrics; i++)
+        base[name, metrics[i]] = field($0, metrics[i])
+    next
+}
+/"name"/ {
+    name = field($0, "name")
+    seen[name] = 1
+    for (i = 1; i <= n_metrics; i++)
+        now[name, metrics[i]] = field($0, metrics[i])
+}
+END {
+    printf "%-18s %-12s %12s %12s %8s\n", "benchmark", "metric", "baseline", "now", "change"
+    for (j = 1; j <= n_names; j++) {
+        name = names[j]
+        if (!seen[name]) {
+            printf "%-18s %-12s %12s %12s %8s  MISSING\n", name, "", "", "", ""
+            failed++
+            continue
+        }
+        for (i = 1; i <= n_metrics; i++) {
+            m = metrics[i]
+            b = base[name, m]; c = now[name, m]
+            if (tol[m] == "" || b + 0 == 0)
+                continue
+            change = (c - b) / b
+            worse = higher[m] ? -change : change
+            flag = ""
+            if (worse > tol[m] + 0 && (higher[m] || c - b > slack)) {
+                flag = "  REGRESSED"
+                failed++
+            }
+            printf "%-18s %-12s %12.2f %12.2f %+7.1f%%%s\n", name, m, b, c, 100 * change, flag
+        }
+    }
+    if (failed) {
+        printf "%d regressions\n", failed
+        exit 1
+    }
+    print "No regressions"
+}' $baseline $out
+val=$?
+rm -f $out
+exit $val
@@ -0,0 +1,83 @@
+/*
+ * file:        probes.h
+ * description: static tracepoints (USDT), for bpftrace and perf
+ *
+ * PROBE1..PROBE3(name, args...) mark a point in the code. Each one
+ * compiles to a single nop plus an ELF note in .note.stapsdt, in the
+ * format <sys/sdt.h> writes - so tools find them the same way, but
+ * nothing extra is needed to build or run. e.g.
+ *
+ *   bpftrace -e 'usdt:./homework:homework:blk_alloc { @[comm] = count(); }'
+ *   perf probe -x ./homework sdt_homework:cache_miss
+ *
+ * The provider is always "homework". Arguments must be integers (cast
+ * pointers to uintptr_t); they're evaluated only for their values, so
+ * keep them cheap. Build with -DNO_PROBES, or on anything but x86-64,
+ * and the probes are compiled out.
+ *
+ * The probes:
+ *   fs_<op>_entry(path), fs_<op>_return(path, val)   every FUSE method
+ *   file_read, file_write(inode, offset, len)        fs_read, fs_write
+ *   blk_read, blk_write(tag, blk, n)                 file system I/O
+ *   image_read, image_write(blk, n)                  image file I/O
+ *   ramdisk_read, ramdisk_write(blk, n)              -ramdisk I/O
+ *   cache_hit, cache_miss(blk, n)                    block cache
+ *   blk_alloc, blk_free(blk)                         block allocator
+ *   inode_alloc, inode_free(inum)                    inode allocator
+ */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#if !defined(NO_PROBES) && defined(__GNUC__) && defined(__x86_64__)
+
+/* the argument's size, negative if it's signed */
+#define _PROBE_SIZE(x) (((__typeof__(x))-1 < (__typeof__(x))1 ? -1 : 1) * (int)sizeof(x))
+
+/* '%n' prints the negated constant - so signed arguments come out as
+ * "-size@operand", as sdt.h has them
+ */
+#define _PROBE_FMT1 "%n[_s1]@%[_a1]"
+#define _PROBE_FMT2 _PROBE_FMT1 " %n[_s2]@%[_a2]"
+#define _PROBE_FMT3 _PROBE_FMT2 " %n[_s3]@%[_a3]"
+#define _PROBE_OP(n, x) [_s##n] "n" (-_PROBE_SIZE(x)), [_a##n] "nor" (x)
+
+#define _PROBE(name, fmt, ...)                                          \
+    __asm__ __volatile__(                                               \
+        "990: nop\n"                                                    \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                   \
+        ".balign 4\n"                                                   \
+        ".4byte 992f-991f, 994f-993f, 3\n"                              \
+        "991: .asciz \"stapsdt\"\n"                                     \
+        "992: .balign 4\n"                                              \
+        "993: .8byte 990b\n"                                            \
+        ".8byte _.stapsdt.base\n"                                       \
+        ".8byte 0\n"                    /* no semaphore */              \
+        ".asciz \"homework\"\n"                                         \
+        ".asciz \"" #name "\"\n"                                        \
+        ".asciz \"" fmt "\"\n"                                          \
+        "994: .balign 4\n"                                              \
+        ".popsection\n"                                                 \
+        ".ifndef _.stapsdt.base\n"                                      \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n"                                        \
+        ".hidden _.stapsdt.base\n"                                      \
+        "_.stapsdt.base: .space 1\n"                                    \
+        ".size _.stapsdt.base, 1\n"                                     \
+        ".popsection\n"                                                 \
+        ".endif\n"                                                      \
+        :: __VA_ARGS__)
+
+#define PROBE1(name, a) _PROBE(name, _PROBE_FMT1, _PROBE_OP(1, a))
+#define PROBE2(name, a, b) _PROBE(name, _PROBE_FMT2, _PROBE_OP(1, a), _PROBE_OP(2, b))
+#define PROBE3(name, a, b, c) \
+    _PROBE(name, _PROBE_FMT3, _PROBE_OP(1, a), _PROBE_OP(2, b), _PROBE_OP(3, c))
+
+#else
+
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * file:        ramdisk.c
+ * description: RAM disk - see ramdisk.h
+ *
+ * Reads and writes are memcpy; like pread/pwrite on an image, requests
+ * to different blocks may run at once from several threads.
+ */
+
+#define _GNU_SOURCE             /* MAP_HUGETLB, MADV_HUGEPAGE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+#include "ramdisk.h"
+#include "probes.h"
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define DUMP_CHUNK (64 * 1024)
+
+struct ramdisk {
+    char *buf;
+    size_t len;                 /* of the mapping - rounded up to pages */
+    size_t pagesz;
+    int64_t nblks;
+    char *dump;
+};
+
+static int64_t ram_num_blocks(struct blkdev *dev)
+{
+    struct ramdisk *rd = dev->private;
+    return rd->nblks;
+}
+
+static int ram_read(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct ramdisk *rd = dev->private;
+    assert(first_blk >= 0 && first_blk + num_blks <= rd->nblks);
+    PROBE2(ramdisk_read, first_blk, num_blks);
+    memcpy(buf, rd->buf + first_blk * BLOCK_SIZE, (size_t)num_blks * BLOCK_SIZE);
+    return SUCCESS;
+}
+
+static int ram_write(struct blkdev *dev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct ramdisk *rd = dev->private;
+    assert(first_blk >= 0 && first_blk + num_blks <= rd->nblks);
+    PROBE2(ramdisk_write, first_blk, num_blks);
+    memcpy(rd->buf + first_blk * BLOCK_SIZE, buf, (size_t)num_blks * BLOCK_SIZE);
+    return SUCCESS;
+}
+
+static int ram_flush(struct blkdev *dev, int64_t first_blk, int num_blks)
+{
+    return SUCCESS;
+}
+
+/* give whole pages back to the host - they read back as zeros - and
+ * leave the partial pages at either end alone
+ */
+static int ram_discard(struct blkdev *dev, int64_t first_blk, int num_blks)
+{
+    struct ramdisk *rd = dev->private;
+    assert(first_blk >= 0 && first_blk + num_blks <= rd->nblks);
+
+    size_t start = first_blk * BLOCK_SIZE, end = (first_blk + num_blks) * BLOCK_SIZE;
+    start = (start + rd->pagesz - 1) / rd->pagesz * rd->pagesz;
+    end = end / rd->pagesz * rd->pagesz;
+    if (start < end)
+        madvise(rd->buf + start, end - start, MADV_DONTNEED);
+    return SUCCESS;
+}
+
+/* write the disk out, skipping chunks of zeros so the file is sparse
+ * where the disk is empty
+ */
+static void ram_dump(struct ramdisk *rd)
+{
+    static char zeros[DUMP_CHUNK];
+    size_t size = rd->nblks * BLOCK_SIZE, off, n;
+    int fd = open(rd->dump, O_WRONLY | O_CREAT, 0666);
+
+    if (fd < 0 || ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+        fprintf(stderr, "can't write RAM disk to %s: %s\n", rd->dump, strerror(errno));
+        exit(1);
+    }
+    for (off = 0; off < size; off += n) {
+        n = size - off < DUMP_CHUNK ? size - off : DUMP_CHUNK;
+        if (memcmp(rd->buf + off, zeros, n) == 0)
+            continue;
+        if (pwrite(fd, rd->buf + off, n, off) != n) {
+            fprintf(stderr, "write error on %s: %s\n", rd->dump, strerror(errno));
+            exit(1);
+        }
+    }
+    if (fsync(fd) < 0) {
+        fprintf(stderr, "flush error on %s: %s\n", rd->dump, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+}
+
+static void ram_close(struct blkdev *dev)
+{
+    struct ramdisk *rd = dev->private;
+    if (rd->dump != NULL) {
+        ram_dump(rd);
+        free(rd->dump);
+    }
+    munmap(rd->buf, rd->len);
+    free(rd);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+struct blkdev_ops ramdisk_ops = {
+    .num_blocks = ram_num_blocks,
+    .read = ram_read,
+    .write = ram_write,
+    .flush = ram_flush,
+    .discard = ram_discard,
+    .close = ram_close
+};
+
+/* anonymous memory is zero-filled, so a fresh disk needs no setup
+ */
+static char *ram_alloc(struct ramdisk *rd, int hugepages)
+{
+    rd->pagesz = sysconf(_SC_PAGESIZE);
+    if (hugepages) {
+        rd->len = (rd->nblks * BLOCK_SIZE + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        rd->buf = mmap(NULL, rd->len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (rd->buf != MAP_FAILED) {
+            rd->pagesz = HUGE_PAGE;
+            return rd->buf;
+        }
+    }
+    rd->len = (rd->nblks * BLOCK_SIZE + rd->pagesz - 1) / rd->pagesz * rd->pagesz;
+    rd->buf = mmap(NULL, rd->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rd->buf == MAP_FAILED)
+        return NULL;
+    if (hugepages)
+        madvise(rd->buf, rd->len, MADV_HUGEPAGE);
+    return rd->buf;
+}
+
+/* read an image file into the buffer
+ */
+static int ram_load(struct ramdisk *rd, int fd, char *image)
+{
+    size_t size = rd->nblks * BLOCK_SIZE, off;
+    ssize_t n;
+
+    for (off = 0; off < size; off += n) {
+        if ((n = pread(fd, rd->buf + off, size - off, off)) <= 0) {
+            fprintf(stderr, "read error on %s: %s\n", image,
+                    n < 0 ? strerror(errno) : "short read");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct blkdev *ramdisk_create(char *image, int64_t nblks, char *dump, int hugepages)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct ramdisk *rd = calloc(1, sizeof(*rd));
+    int fd = -1;
+
+    if (dev == NULL || rd == NULL)
+        return NULL;
+
+    if (image != NULL) {
+        struct stat sb;
+        if ((fd = open(image, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+            fprintf(stderr, "can't open image %s: %s\n", image, strerror(errno));
+            return NULL;
+        }
+        if (sb.st_size % BLOCK_SIZE != 0)
+            fprintf(stderr, "warning: file %s not a multiple of %d bytes\n",
+                    image, BLOCK_SIZE);
+        nblks = sb.st_size / BLOCK_SIZE;
+    }
+    rd->nblks = nblks;
+
+    if (ram_alloc(rd, hugepages) == NULL) {
+        fprintf(stderr, "can't allocate %lld-block RAM disk: %s\n", (long long)nblks,
+                strerror(errno));
+        return NULL;
+    }
+    if (fd >= 0) {
+        int val = ram_load(rd, fd, image);
+        close(fd);
+        if (val < 0)
+            return NULL;
+    }
+
+    rd->dump = dump ? strdup(dump) : NULL;
+    dev->private = rd;
+    dev->ops = &ramdisk_ops;
+    return dev;
+}
@@ -0,0 +1,22 @@
+/*
+ * file:        ramdisk.h
+ * description: RAM disk - a blkdev held in an anonymous memory buffer
+ *
+ * For benchmarks and tests that should measure the file system and
+ * not the host's page cache and fsync. Flush does nothing; nothing is
+ * kept unless the disk is dumped to a file on close.
+ */
+#ifndef __RAMDISK_H__
+#define __RAMDISK_H__
+
+#include "blkdev.h"
+
+/* 'nblks' zeroed blocks, or if 'image' isn't NULL, a copy of that
+ * image file (and 'nblks' is ignored). On close, if 'dump' isn't NULL
+ * the contents are written there - it may be the image itself. With
+ * 'hugepages' the buffer is allocated in huge pages if the host has
+ * any reserved, and otherwise asks for transparent huge pages.
+ */
+extern struct blkdev *ramdisk_create(char *image, int64_t nblks, char *dump, int hugepages);
+
+#endif
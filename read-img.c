@@ -2,35 +2,265 @@
  * file:        read-img.c
  * description: read and print summary of cs5600/cs7600 file system
  *              volume. 
+ *
+ * usage: read-img [-a] [-cells #] [-csv file] file.img
+ *     -a       layout analysis instead of the inode, block and per-file
+ *              block lists: extents per file, contiguity, free space
+ *              fragmentation, directory/inode/data distances and a
+ *              heatmap of the allocated blocks
+ *     -cells   number of heatmap cells (default 1024)
+ *     -csv     also write the heatmap to 'file', a cell per line
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 
 #include "fsx600.h"
+#include "bitmap.h"
+#include "journal.h"
+
+fd_set *blkmap;                 /* blocks reached from the root */
+fd_set *block_map;              /* blocks marked in use */
+int prev_blk, extents;
+int analyze;                    /* -a */
+int64_t file_blks, first_blk;   /* of the file being listed */
+
+/* -a: what we found for each file and directory
+ */
+struct layout {
+    int inum;
+    int dir;
+    int extents;
+    int64_t blks;
+    int64_t dir_dist;           /* parent's block to the inode's, or -1 */
+    int64_t data_dist;          /* inode's block to the first data block, or -1 */
+} *files;
+int n_files;
+
+/* record one data block pointer of a file, counting extents - runs of
+ * consecutive disk blocks in file order. Unwritten (preallocated)
+ * blocks are printed with a 'u'.
+ */
+void data_blk(uint32_t ptr)
+{
+    int blk = BLK_NUM(ptr);
+    if (!ptr)
+        return;
+    if (!analyze)
+        printf("%d%s ", blk, (ptr & BLK_UNWRITTEN) ? "u" : "");
+    if (file_blks++ == 0)
+        first_blk = blk;
+    FD_SET(blk, blkmap);
+    if (!FD_ISSET(blk, block_map))
+        printf("\n***ERROR*** block %d marked free\n", blk);
+    if (blk != prev_blk + 1)
+        extents++;
+    prev_blk = blk;
+}
+
+/* histograms are by powers of two: 1, 2-3, 4-7, ...
+ */
+#define N_BUCKETS 40
+
+int bucket(int64_t n)
+{
+    int b = 0;
+    while (n > 1)
+        n >>= 1, b++;
+    return b;
+}
+
+void print_hist(char *title, char *unit, int64_t *count, int64_t *blocks)
+{
+    int b;
+    char range[32];
+    printf("  %-14s %10s", title, unit);
+    printf(blocks ? " %10s\n" : "\n", "blocks");
+    for (b = 0; b < N_BUCKETS; b++) {
+        if (count[b] == 0)
+            continue;
+        if (b == 0)
+            sprintf(range, "1");
+        else
+            sprintf(range, "%lld-%lld", 1LL << b, (2LL << b) - 1);
+        printf("  %-14s %10lld", range, (long long)count[b]);
+        if (blocks)
+            printf(" %10lld", (long long)blocks[b]);
+        printf("\n");
+    }
+}
+
+int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(int64_t*)a, y = *(int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* average and median of the distances that aren't -1
+ */
+void print_dist(char *title, size_t offset)
+{
+    int64_t *d = malloc((n_files + 1) * sizeof(*d)), sum = 0;
+    int i, n = 0;
+    for (i = 0; i < n_files; i++) {
+        int64_t v = *(int64_t*)((char*)&files[i] + offset);
+        if (v >= 0)
+            sum += (d[n++] = v);
+    }
+    qsort(d, n, sizeof(*d), cmp_int64);
+    if (n == 0)
+        printf("  %-16s -\n", title);
+    else
+        printf("  %-16s avg %.1f median %lld max %lld blocks\n", title,
+               (double)sum / n, (long long)d[n / 2], (long long)d[n - 1]);
+    free(d);
+}
+
+/* the -a report: how files are laid out, how free space is broken up,
+ * and a map of where the allocated blocks are
+ */
+void layout_report(struct fs_super *sb, int data_start, int cells, char *csv)
+{
+    int64_t ext_count[N_BUCKETS] = {0}, free_count[N_BUCKETS] = {0};
+    int64_t free_blocks[N_BUCKETS] = {0};
+    int64_t blks = 0, n_ext = 0, with_data = 0, n_free = 0, n_runs = 0, largest = 0;
+    int64_t i, len, nblks = sb->num_blocks;
+    int worst = -1, n_dirs = 0;
+
+    for (i = 0; i < n_files; i++) {
+        n_dirs += files[i].dir;
+        if (files[i].blks == 0)
+            continue;
+        with_data++;
+        blks += files[i].blks;
+        n_ext += files[i].extents;
+        ext_count[bucket(files[i].extents)]++;
+        if (worst < 0 || files[i].extents > files[worst].extents)
+            worst = i;
+    }
+    printf("layout:\n");
+    printf("  files:      %d (%lld with data) and %d directories, %lld data blocks\n",
+           n_files - n_dirs, (long long)with_data, n_dirs, (long long)blks);
+    if (worst >= 0)
+        printf("  extents:    %lld, avg %.2f per file, max %d (inode %d)\n",
+               (long long)n_ext, (double)n_ext / with_data, files[worst].extents,
+               files[worst].inum);
+
+    /* of the steps from one block of a file to the next, the fraction
+     * that go to the next block on disk */
+    int64_t steps = blks - with_data;
+    printf("  contiguity: %.4f (%lld of %lld steps to the next block)\n",
+           steps ? (double)(blks - n_ext) / steps : 1.0, (long long)(blks - n_ext),
+           (long long)steps);
+
+    for (i = data_start; (i = bitmap_find_zero(block_map, i, nblks)) >= 0; i += len) {
+        int64_t end = bitmap_find_set(block_map, i, nblks);
+        len = (end < 0 ? nblks : end) - i;
+        free_count[bucket(len)]++;
+        free_blocks[bucket(len)] += len;
+        n_free += len;
+        n_runs++;
+        if (len > largest)
+            largest = len;
+    }
+    printf("  free:       %lld blocks in %lld runs, largest %lld (%.1f%% of free)\n",
+           (long long)n_free, (long long)n_runs, (long long)largest,
+           n_free ? 100.0 * largest / n_free : 0);
+    printf("\n");
+    if (worst >= 0) {
+        print_hist("extents", "files", ext_count, NULL);
+        printf("\n");
+    }
+    if (n_runs) {
+        print_hist("free run", "runs", free_count, free_blocks);
+        printf("\n");
+    }
+
+    printf("distance:\n");
+    print_dist("dir -> inode", offsetof(struct layout, dir_dist));
+    print_dist("inode -> data", offsetof(struct layout, data_dist));
+    printf("\n");
+
+    /* heatmap - each cell is 'per' blocks, shaded by how many of them
+     * are allocated: ' ' none ... '@' all */
+    static char shades[] = " .:-=+*#%@";
+    int64_t per = (nblks + cells - 1) / cells;
+    cells = (nblks + per - 1) / per;
+    int64_t *used = calloc(cells, sizeof(*used));
+    for (i = 0; (i = bitmap_find_set(block_map, i, nblks)) >= 0; i++)
+        used[i / per]++;
+
+    printf("heatmap: %lld blocks per cell, ' ' empty to '@' full\n", (long long)per);
+    for (i = 0; i < cells; i++) {
+        int64_t total = (i == cells - 1) ? nblks - i * per : per;
+        int shade = used[i] == 0 ? 0 : used[i] == total ? 9 : 1 + used[i] * 8 / total;
+        if (i % 64 == 0)
+            printf("%10lld |", (long long)(i * per));
+        putchar(shades[shade]);
+        if (i % 64 == 63 || i == cells - 1)
+            printf("|\n");
+    }
+
+    if (csv != NULL) {
+        FILE *fp = fopen(csv, "w");
+        if (fp == NULL)
+            perror("can't open csv file"), exit(1);
+        fprintf(fp, "first_blk,blocks,allocated\n");
+        for (i = 0; i < cells; i++)
+            fprintf(fp, "%lld,%lld,%lld\n", (long long)(i * per),
+                    (long long)((i == cells - 1) ? nblks - i * per : per), (long long)used[i]);
+        fclose(fp);
+    }
+    free(used);
+}
 
 int main(int argc, char **argv)
 {
-    int i, j, fd = open(argv[1], O_RDONLY);
-    if (fd < 0)
+    int i, j, fd, cells = 1024;
+    char *csv = NULL;
+
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-a"))
+            analyze = 1;
+        else if (!strcmp(argv[1], "-cells") && argc > 3) {
+            cells = atoi(argv[2]);
+            argv++, argc--;
+        }
+        else if (!strcmp(argv[1], "-csv") && argc > 3) {
+            csv = argv[2];
+            argv++, argc--;
+        }
+        else
+            break;
+        argv++, argc--;
+    }
+    if (argc != 2 || cells < 1) {
+        printf("usage: read-img [-a] [-cells #] [-csv file] file.img\n");
+        exit(1);
+    }
+    if ((fd = open(argv[1], O_RDONLY)) < 0)
         perror("can't open"), exit(1);
     struct stat _sb;
     if (fstat(fd, &_sb) < 0)
         perror("fstat"), exit(1);
-    int size = _sb.st_size;
+    off_t size = _sb.st_size;
 
-    void *disk = malloc(size);
-    if (read(fd, disk, size) != size)
-        perror("read"), exit(1);
-    fd_set *blkmap = calloc(size/8192, 1);
-    fd_set *imap = calloc(size/8192, 1);
+    /* map rather than read - images may be many GB, mostly holes
+     */
+    void *disk = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (disk == MAP_FAILED)
+        perror("mmap"), exit(1);
+    blkmap = calloc(size/8192 + 8, 1);      /* whole 64-bit words */
+    fd_set *imap = calloc(size/8192 + 8, 1);
 
     struct fs_super *sb = (void*)disk;
     printf("superblock: magic:  %08x\n"
@@ -38,97 +268,137 @@ int main(int argc, char **argv)
            "            bmap:   %d blocks\n"
            "            inodes: %d blocks\n" 
            "            blocks: %d\n"
-           "            root inode: %d\n\n", sb->magic, sb->inode_map_sz,
-           sb->block_map_sz, sb->inode_region_sz, sb->num_blocks, sb->root_inode);
+           "            root inode: %d\n"
+           "            state:  %s\n\n", sb->magic, sb->inode_map_sz,
+           sb->block_map_sz, sb->inode_region_sz, sb->num_blocks, sb->root_inode,
+           sb->state == FS_CLEAN ? "clean" : "dirty");
+    if (sb->journal_sz != 0) {
+        /* the image as it is on disk - a committed transaction in the
+         * journal is only replayed at mount time */
+        struct jnl_header *jh = (void*)disk + sb->journal_base * FS_BLOCK_SIZE;
+        printf("journal:    blocks %d-%d\n", sb->journal_base, sb->journal_base + sb->journal_sz - 1);
+        if (jh->magic == JNL_MAGIC)
+            printf("            last commit: seq %llu, %d blocks\n",
+                   (unsigned long long)jh->seq, jh->n_blocks);
+        printf("\n");
+        for (i = 0; i < sb->journal_sz; i++)
+            FD_SET(sb->journal_base + i, blkmap);
+    }
 
-    printf("allocated inodes: ");
     fd_set *inode_map = (void*)disk + FS_BLOCK_SIZE;
+    block_map = (void*)inode_map + sb->inode_map_sz * FS_BLOCK_SIZE;
     char *comma = "";
-    for (i = 0; i < sb->inode_map_sz * 8192; i++)
-        if (FD_ISSET(i, inode_map)) {
+    if (!analyze) {
+        printf("allocated inodes: ");
+        for (i = 0; (i = bitmap_find_set(inode_map, i, sb->inode_map_sz * 8192)) >= 0; i++) {
             printf("%s %d", comma, i);
             comma = ",";
         }
-    printf("\n\n");
+        printf("\n\n");
 
-    printf("allocated blocks: ");
-    fd_set *block_map = (void*)inode_map + sb->inode_map_sz * FS_BLOCK_SIZE;
-    for (comma = "", i = 0; i < sb->block_map_sz * 8192; i++)
-        if (FD_ISSET(i, block_map)) {
+        printf("allocated blocks: ");
+        for (comma = "", i = 0; (i = bitmap_find_set(block_map, i, sb->block_map_sz * 8192)) >= 0; i++) {
             printf("%s %d", comma, i);
             comma = ",";
         }
         printf("\n\n");
+    }
 
     struct fs_inode *inodes = (void*)block_map + sb->block_map_sz * FS_BLOCK_SIZE;
 
     int max_inodes = sb->inode_region_sz * INODES_PER_BLK;
-    struct entry { int dir; int inum;} inode_list[max_inodes + 100];
+    struct entry { int dir; int inum; int parent_blk;} *inode_list;
+    inode_list = malloc((max_inodes + 100) * sizeof(*inode_list));
+    files = malloc((max_inodes + 100) * sizeof(*files));
     int head = 0, tail = 0;
+    int inode_base = 1 + sb->inode_map_sz + sb->block_map_sz;
 
-    inode_list[head++] = (struct entry){.dir=1, .inum=1};
+    inode_list[head++] = (struct entry){.dir=1, .inum=1, .parent_blk=-1};
     FD_SET(1, imap);
     while (head != tail) {
         struct entry e = inode_list[tail++];
         struct fs_inode *in = inodes + e.inum;
+        int64_t inode_blk = inode_base + e.inum / INODES_PER_BLK;
+        struct layout *l = &files[n_files++];
+        *l = (struct layout){.inum = e.inum, .dir = e.dir, .dir_dist = -1, .data_dist = -1};
+        if (e.parent_blk >= 0)
+            l->dir_dist = llabs(inode_blk - e.parent_blk);
         if (!e.dir) {
-            printf("file: inode %d\n"
-                   "      uid/gid %d/%d\n"
-                   "      mode %08o\n"
-                   "      size  %d\n",
-                   e.inum, in->uid, in->gid, in->mode, in->size);
-            printf("blocks: ");
+            if (!analyze) {
+                printf("file: inode %d\n"
+                       "      uid/gid %d/%d\n"
+                       "      mode %08o\n"
+                       "      size  %lld\n",
+                       e.inum, in->uid, in->gid, in->mode, (long long)in->size);
+                printf("blocks: ");
+            }
+            prev_blk = -1;
+            extents = 0;
+            file_blks = 0;
             for (i = 0; i < 6; i++)
-                if (in->direct[i]) {
-                    printf("%d ", in->direct[i]);
-                    FD_SET(in->direct[i], blkmap);
-                    if (!FD_ISSET(in->direct[i], block_map))
-                        printf("\n***ERROR*** block %d marked free\n", in->direct[i]);
-                }
+                data_blk(in->direct[i]);
             if (in->indir_1) {
-                int *buf = disk + in->indir_1 * FS_BLOCK_SIZE;
+                int *buf = disk + (off_t)in->indir_1 * FS_BLOCK_SIZE;
+                FD_SET(in->indir_1, blkmap);
                 for (i = 0; i < 256; i++)
-                    if (buf[i]) {
-                        printf("%d ", buf[i]);
-                        FD_SET(buf[i], blkmap);
-                        if (!FD_ISSET(buf[i], block_map))
-                            printf("\n***ERROR*** block %d marked free\n", buf[i]);
-                    }
+                    data_blk(buf[i]);
             }
             if (in->indir_2) {
-                int *buf2 = disk + in->indir_2 * FS_BLOCK_SIZE;
+                int *buf2 = disk + (off_t)in->indir_2 * FS_BLOCK_SIZE;
+                FD_SET(in->indir_2, blkmap);
                 for (i = 0; i < 256; i++) {
-                    if (buf2[i])
-                    {
-                        int *buf = disk + buf2[i] * FS_BLOCK_SIZE;
-                        for (j = 0; j < 256; j++) {
-                            if (buf[j]) {
-                                printf("%d ", buf[j]);
-                                FD_SET(buf[j], blkmap);
-                                if (!FD_ISSET(buf[j], block_map))
-                                    printf("\n***ERROR*** block %d marked free\n", buf[j]);
-                            }
-                        }
+                    if (!buf2[i])
+                        continue;
+                    int *buf = disk + (off_t)buf2[i] * FS_BLOCK_SIZE;
+                    FD_SET(buf2[i], blkmap);
+                    for (j = 0; j < 256; j++)
+                        data_blk(buf[j]);
+                }
+            }
+            if (in->indir_3) {
+                int k, *buf3 = disk + (off_t)in->indir_3 * FS_BLOCK_SIZE;
+                FD_SET(in->indir_3, blkmap);
+                for (k = 0; k < 256; k++) {
+                    if (!buf3[k])
+                        continue;
+                    int *buf2 = disk + (off_t)buf3[k] * FS_BLOCK_SIZE;
+                    FD_SET(buf3[k], blkmap);
+                    for (i = 0; i < 256; i++) {
+                        if (!buf2[i])
+                            continue;
+                        int *buf = disk + (off_t)buf2[i] * FS_BLOCK_SIZE;
+                        FD_SET(buf2[i], blkmap);
+                        for (j = 0; j < 256; j++)
+                            data_blk(buf[j]);
                     }
                 }
             }
-            printf("\n\n");
+            l->extents = extents;
+            if ((l->blks = file_blks) > 0)
+                l->data_dist = llabs(first_blk - inode_blk);
+            if (!analyze) {
+                printf("\nextents: %d", extents);
+                printf("\n\n");
+            }
         }
         else {
             if (!S_ISDIR(in->mode)) {
                 printf("***ERROR*** inode %d not a directory\n", e.inum);
                 continue;
             }
-            printf("directory: inode %d (block %d)\n", e.inum, in->direct[0]);
-            struct fs_dirent *de = disk + in->direct[0] * FS_BLOCK_SIZE;
+            if (!analyze)
+                printf("directory: inode %d (block %d)\n", e.inum, in->direct[0]);
+            l->data_dist = llabs(in->direct[0] - inode_blk);
+            struct fs_dirent *de = disk + (off_t)in->direct[0] * FS_BLOCK_SIZE;
             if (!FD_ISSET(in->direct[0], block_map))
                 printf("\n***ERROR*** block %d marked free\n", in->direct[0]);
             FD_SET(in->direct[0], blkmap);
             
             for (i = 0; i < 32; i++)
                 if (de[i].valid) {
-                    printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
-                           de[i].name);
+                    if (!analyze)
+                        printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
+                               de[i].name);
                     int j = de[i].inode;
                     if (j < 0 || j >= sb->inode_region_sz * 16) {
                         printf("***ERROR*** invalid inode %d\n", j);
@@ -141,25 +411,33 @@ int main(int argc, char **argv)
                     FD_SET(j, imap);
                     if (!FD_ISSET(j, inode_map))
                         printf("***ERROR*** inode %d is marked free\n", j);
-                    inode_list[head++] = (struct entry) {.dir = de[i].isDir, j};
+                    inode_list[head++] = (struct entry) {.dir = de[i].isDir, j,
+                                                         in->direct[0]};
                 }
-            printf("\n");
+            if (!analyze)
+                printf("\n");
         }
     }
 
     printf("unreachable inodes: ");
-    for (i = 1; i < sb->inode_region_sz * 16; i++)
-        if (!FD_ISSET(i, imap) && FD_ISSET(i, inode_map))
-            printf("%d ", i);
+    for (i = 1; (i = bitmap_find_andnot(inode_map, imap, i, sb->inode_region_sz * INODES_PER_BLK)) >= 0; i++)
+        printf("%d ", i);
     printf("\n");
 
     printf("unreachable blocks: ");
     for (i = 1 + sb->inode_map_sz + sb->block_map_sz + sb->inode_region_sz;
-         i < sb->num_blocks; i++)
-        if (FD_ISSET(i, blkmap) && !FD_ISSET(i, block_map))
-            printf("%d ", i);
+         (i = bitmap_find_andnot(block_map, blkmap, i, sb->num_blocks)) >= 0; i++)
+        printf("%d ", i);
     printf("\n");
 
+    if (analyze) {
+        int data_start = inode_base + sb->inode_region_sz;
+        if (sb->journal_sz != 0)
+            data_start = sb->journal_base + sb->journal_sz;
+        printf("\n");
+        layout_report(sb, data_start, cells, csv);
+    }
+
 fail:
     return 0;
 }
@@ -0,0 +1,319 @@
+/*
+ * file:        simdisk.c
+ * description: simulated disk - see simdisk.h
+ *
+ * The models:
+ *  hdd  a 7200 RPM drive with no write cache: a request that doesn't
+ *       start where the last one ended pays a seek (growing with the
+ *       square root of the distance, as the arm accelerates) plus half
+ *       a rotation on average; every request pays transfer time. Reads
+ *       of blocks in the drive's cache (the last CACHE_BLKS blocks
+ *       read or written, direct-mapped) only pay transfer time. One
+ *       request at a time.
+ *  ssd  each 4KB page a request touches costs read_us or write_us on
+ *       one of 'qd' channels, whichever is free first - so one large
+ *       request, or several threads' small ones, go in parallel.
+ *  net  half a round trip to the server, the data over a link of
+ *       mb_s shared by all requests, and half a round trip back; a
+ *       flush is one more round trip.
+ *
+ * The virtual clock: a request arrives at its thread's clock (and no
+ * earlier than the request before it - they come in order), waits for
+ * the unit it needs (the arm, a channel, the link), and the thread's
+ * clock moves on to when it finishes. A thread's clock is shared by
+ * all the simulated disks it uses; there is normally only one.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "simdisk.h"
+#include "iostat.h"
+
+#define CACHE_BLKS     8192             /* 8MB */
+#define PAGE_BLKS      4                /* SSD page - 4KB */
+
+enum {HDD, SSD, NET, N_MODELS};
+static char *model_names[] = {"hdd", "ssd", "net"};
+
+struct sim_params {
+    double seek_us, full_seek_us, rpm, mb_s;    /* hdd, and net's mb_s */
+    double read_us, write_us, qd;               /* ssd */
+    double rtt_us;                              /* net */
+};
+
+static struct sim_params defaults[] = {
+    [HDD] = {.seek_us = 500, .full_seek_us = 15000, .rpm = 7200, .mb_s = 150},
+    [SSD] = {.read_us = 80, .write_us = 25, .qd = 32},
+    [NET] = {.rtt_us = 500, .mb_s = 110},       /* gigabit ethernet */
+};
+
+static struct {
+    char *name;
+    size_t offset;
+} param_names[] = {
+    {"seek_us", offsetof(struct sim_params, seek_us)},
+    {"full_seek_us", offsetof(struct sim_params, full_seek_us)},
+    {"rpm", offsetof(struct sim_params, rpm)},
+    {"mb_s", offsetof(struct sim_params, mb_s)},
+    {"read_us", offsetof(struct sim_params, read_us)},
+    {"write_us", offsetof(struct sim_params, write_us)},
+    {"qd", offsetof(struct sim_params, qd)},
+    {"rtt_us", offsetof(struct sim_params, rtt_us)},
+};
+#define N_PARAMS (sizeof(param_names) / sizeof(param_names[0]))
+
+struct simdisk {
+    struct blkdev *dev;
+    pthread_mutex_t lock;       /* the model is shared by all callers */
+    int model;
+    struct sim_params p;
+    int64_t nblks;
+    int64_t head;               /* block after the last request */
+    int n_units;                /* the arm, SSD channels, the link */
+    double *free_us;            /* when each unit is next free */
+    double arrival_us;          /* of the latest request */
+    double end_us;              /* when the last request finished */
+    long n_reads, n_writes, n_seeks, n_flushes;
+    int64_t blks_read, blks_written;
+    struct io_hist lat[2];      /* modeled read and write latency */
+    int64_t cache[CACHE_BLKS];          /* block number + 1, or 0 */
+};
+
+static __thread double thread_us;
+
+static int cached(struct simdisk *s, int64_t first_blk, int num_blks)
+{
+    int i;
+    for (i = 0; i < num_blks; i++)
+        if (s->cache[(first_blk + i) % CACHE_BLKS] != first_blk + i + 1)
+            return 0;
+    return 1;
+}
+
+static void cache_fill(struct simdisk *s, int64_t first_blk, int num_blks)
+{
+    int i;
+    for (i = 0; i < num_blks; i++)
+        s->cache[(first_blk + i) % CACHE_BLKS] = first_blk + i + 1;
+}
+
+static double later(double a, double b)
+{
+    return a > b ? a : b;
+}
+
+/* each model returns when a request arriving at 'start' finishes */
+static double hdd_time(struct simdisk *s, int write, double start, int64_t first_blk, int num_blks)
+{
+    double t = later(start, s->free_us[0]);
+    double xfer = num_blks * (double)BLOCK_SIZE / s->p.mb_s;
+
+    if (write || !cached(s, first_blk, num_blks)) {
+        if (first_blk != s->head) {
+            double dist = llabs(first_blk - s->head) / (double)s->nblks;
+            t += s->p.seek_us + (s->p.full_seek_us - s->p.seek_us) * sqrt(dist) +
+                30e6 / s->p.rpm;
+            s->n_seeks++;
+        }
+        s->head = first_blk + num_blks;
+    }
+    cache_fill(s, first_blk, num_blks);
+    return s->free_us[0] = t + xfer;
+}
+
+static double ssd_time(struct simdisk *s, int write, double start, int64_t first_blk, int num_blks)
+{
+    int64_t page, last = (first_blk + num_blks - 1) / PAGE_BLKS;
+    double done = start;
+    int i, unit;
+
+    for (page = first_blk / PAGE_BLKS; page <= last; page++) {
+        for (unit = 0, i = 1; i < s->n_units; i++)
+            if (s->free_us[i] < s->free_us[unit])
+                unit = i;
+        s->free_us[unit] = later(start, s->free_us[unit]) +
+            (write ? s->p.write_us : s->p.read_us);
+        done = later(done, s->free_us[unit]);
+    }
+    return done;
+}
+
+static double net_time(struct simdisk *s, int write, double start, int64_t first_blk, int num_blks)
+{
+    double t = later(start + s->p.rtt_us / 2, s->free_us[0]);
+    s->free_us[0] = t + num_blks * (double)BLOCK_SIZE / s->p.mb_s;
+    return s->free_us[0] + s->p.rtt_us / 2;
+}
+
+static void charge(struct simdisk *s, int write, int64_t first_blk, int num_blks)
+{
+    static double (*model_time[])(struct simdisk *, int, double, int64_t, int) = {
+        [HDD] = hdd_time, [SSD] = ssd_time, [NET] = net_time};
+
+    pthread_mutex_lock(&s->lock);
+    double start = s->arrival_us = later(thread_us, s->arrival_us);
+    thread_us = model_time[s->model](s, write, start, first_blk, num_blks);
+    s->end_us = later(s->end_us, thread_us);
+    io_hist_add(&s->lat[write], (thread_us - start) * 1000);
+    if (write) {
+        s->n_writes++;
+        s->blks_written += num_blks;
+    }
+    else {
+        s->n_reads++;
+        s->blks_read += num_blks;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int64_t sim_num_blocks(struct blkdev *sdev)
+{
+    struct simdisk *s = sdev->private;
+    return s->dev->ops->num_blocks(s->dev);
+}
+
+static int sim_read(struct blkdev *sdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct simdisk *s = sdev->private;
+    charge(s, 0, first_blk, num_blks);
+    return s->dev->ops->read(s->dev, first_blk, num_blks, buf);
+}
+
+static int sim_write(struct blkdev *sdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct simdisk *s = sdev->private;
+    charge(s, 1, first_blk, num_blks);
+    return s->dev->ops->write(s->dev, first_blk, num_blks, buf);
+}
+
+/* with no write cache, a flush costs a local disk nothing; over the
+ * network it is a round trip
+ */
+static int sim_flush(struct blkdev *sdev, int64_t first_blk, int num_blks)
+{
+    struct simdisk *s = sdev->private;
+    pthread_mutex_lock(&s->lock);
+    if (s->model == NET) {
+        double start = s->arrival_us = later(thread_us, s->arrival_us);
+        thread_us = start + s->p.rtt_us;
+        s->end_us = later(s->end_us, thread_us);
+    }
+    s->n_flushes++;
+    pthread_mutex_unlock(&s->lock);
+    return s->dev->ops->flush(s->dev, first_blk, num_blks);
+}
+
+/* discards are taken as free - a hard disk ignores them, and an SSD
+ * or a server only notes them
+ */
+static int sim_discard(struct blkdev *sdev, int64_t first_blk, int num_blks)
+{
+    struct simdisk *s = sdev->private;
+    return s->dev->ops->discard(s->dev, first_blk, num_blks);
+}
+
+static void sim_close(struct blkdev *sdev)
+{
+    struct simdisk *s = sdev->private;
+    s->dev->ops->close(s->dev);
+    free(s->free_us);
+    free(s);
+    free(sdev);
+}
+
+struct blkdev_ops sim_ops = {
+    .num_blocks = sim_num_blocks,
+    .read = sim_read,
+    .write = sim_write,
+    .flush = sim_flush,
+    .discard = sim_discard,
+    .close = sim_close
+};
+
+/* "model[:name=value,...]" - returns 0, or -1 after printing why not
+ */
+static int parse_spec(struct simdisk *s, const char *spec)
+{
+    char buf[strlen(spec) + 1], *params, *p, *save = NULL;
+    int i;
+
+    strcpy(buf, spec);
+    if ((params = strchr(buf, ':')) != NULL)
+        *params++ = 0;
+    else
+        params = "";
+    for (s->model = 0; s->model < N_MODELS; s->model++)
+        if (!strcmp(buf, model_names[s->model]))
+            break;
+    if (s->model == N_MODELS) {
+        fprintf(stderr, "simdisk: unknown model '%s' (hdd, ssd or net)\n", buf);
+        return -1;
+    }
+    s->p = defaults[s->model];
+
+    for (p = strtok_r(params, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(p, '=');
+        if (val != NULL)
+            *val++ = 0;
+        for (i = 0; i < N_PARAMS; i++)
+            if (!strcmp(p, param_names[i].name))
+                break;
+        if (val == NULL || i == N_PARAMS || atof(val) <= 0) {
+            fprintf(stderr, "simdisk: bad parameter '%s'\n", p);
+            return -1;
+        }
+        *(double *)((char *)&s->p + param_names[i].offset) = atof(val);
+    }
+    return 0;
+}
+
+struct blkdev *simdisk_create(struct blkdev *dev, const char *spec)
+{
+    struct blkdev *sdev = malloc(sizeof(*sdev));
+    struct simdisk *s = calloc(1, sizeof(*s));
+
+    if (sdev == NULL || s == NULL)
+        return NULL;
+    if (parse_spec(s, spec) < 0) {
+        free(s);
+        free(sdev);
+        return NULL;
+    }
+    s->n_units = s->model == SSD ? (int)s->p.qd : 1;
+    if (s->n_units < 1)
+        s->n_units = 1;
+    s->free_us = calloc(s->n_units, sizeof(*s->free_us));
+    s->dev = dev;
+    pthread_mutex_init(&s->lock, NULL);
+    s->nblks = dev->ops->num_blocks(dev);
+    sdev->ops = &sim_ops;
+    sdev->private = s;
+    return sdev;
+}
+
+double simdisk_clock(struct blkdev *sdev)
+{
+    struct simdisk *s = sdev->private;
+    pthread_mutex_lock(&s->lock);
+    double t = s->end_us / 1e6;
+    pthread_mutex_unlock(&s->lock);
+    return t;
+}
+
+void simdisk_report(struct blkdev *sdev, FILE *fp)
+{
+    struct simdisk *s = sdev->private;
+    struct io_hist *rd = &s->lat[0], *wr = &s->lat[1];
+    pthread_mutex_lock(&s->lock);
+    fprintf(fp, "reads %ld (%lld blocks) writes %ld (%lld blocks) seeks %ld modeled %.3f s"
+            " - %s, flushes %ld, read avg %.1f p99 %.1f us, write avg %.1f p99 %.1f us\n",
+            s->n_reads, (long long)s->blks_read, s->n_writes, (long long)s->blks_written,
+            s->n_seeks, s->end_us / 1e6, model_names[s->model], s->n_flushes,
+            rd->n ? rd->sum / 1e3 / rd->n : 0, io_hist_quantile(rd, 0.99) / 1e3,
+            wr->n ? wr->sum / 1e3 / wr->n : 0, io_hist_quantile(wr, 0.99) / 1e3);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * file:        simdisk.h
+ * description: simulated disk - a blkdev wrapper that charges each
+ *              request against a latency model of a hard disk, SSD or
+ *              network-attached disk, on a virtual clock, and passes
+ *              it through unchanged
+ *
+ * Nothing sleeps: the model only adds up how long the requests would
+ * have taken, so a benchmark can report projected I/O time for media
+ * it isn't running on.
+ *
+ * The model is named by a spec, "hdd", "ssd" or "net", optionally
+ * followed by parameters to change - e.g. "ssd:qd=4,read_us=100":
+ *   hdd  seek_us (track-to-track), full_seek_us, rpm, mb_s
+ *   ssd  read_us, write_us (per 4KB page), qd (pages in parallel)
+ *   net  rtt_us, mb_s
+ * Each thread has its own virtual clock - its requests are serial -
+ * and requests from different threads overlap as far as the model
+ * allows (an SSD's queue depth, a network's round trips).
+ */
+#ifndef __SIMDISK_H__
+#define __SIMDISK_H__
+
+#include <stdio.h>
+#include "blkdev.h"
+
+/* NULL, with a message, if the spec is bad */
+extern struct blkdev *simdisk_create(struct blkdev *dev, const char *spec);
+
+/* modeled time so far, in seconds - when the last request finished */
+extern double simdisk_clock(struct blkdev *sdev);
+
+/* print request counts, modeled time and modeled latencies */
+extern void simdisk_report(struct blkdev *sdev, FILE *fp);
+
+#endif
@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# file:        stats-test.sh
+# description: tests of the /.fsstats virtual file - its contents, read
+#              in small pieces, and that it can't be created over
+#
+
+if [ x$1 = x-v ] ; then
+    verbose=t; shift
+fi
+
+cmd=./homework
+disk=/tmp/$USER-stats.img
+src=/tmp/src-$$
+out=/tmp/output-$$
+
+for f in $cmd ./mktest; do
+  if [ ! -f $f ] ; then
+      echo "Unable to access: $f"
+      exit
+  fi
+done
+./mktest $disk
+
+echo Testing /.fsstats
+
+echo 'stats test' > $src
+
+# 'show' reads 64 bytes at a time, so the file comes in several pieces
+$cmd -cmdline -image $disk > $out <<EOF
+mkdir .fsstats
+put $src .fsstats
+rename file.7 .fsstats
+ls
+ls-l .fsstats
+show file.A
+blksiz 64
+show .fsstats
+EOF
+[ "$verbose" ] && echo wrote $out
+
+fail=
+n=$(grep -c '^error: File exists' $out)
+if [ $n != 3 ] ; then
+    echo "mkdir, put and rename onto .fsstats: $n of 3 failed with EEXIST"
+    fail=1
+fi
+if sed -n '/^cmd> ls$/,/^cmd> ls-l/p' $out | grep -v '^cmd>' | grep -q fsstats ; then
+    echo ".fsstats should not appear in the root directory"
+    fail=1
+fi
+set x $(grep '^/.fsstats' $out)
+if [ "$3" != "-r--r--r--" ] ; then
+    echo ".fsstats: mode '$3' should be -r--r--r--"
+    fail=1
+fi
+
+# the text after 'show .fsstats' - one header and a line per operation,
+# each operation once
+sed -n '/^cmd> show .fsstats$/,$p' $out | sed '1d;$d' > $out.stats
+n=$(grep -c '^op  *calls  *avg_us' $out.stats)
+if [ $n != 1 ] ; then
+    echo ".fsstats: $n header lines, should be 1"
+    fail=1
+fi
+dups=$(awk '{print $1}' $out.stats | sort | uniq -d)
+if [ "$dups" ] ; then
+    echo ".fsstats: operations listed twice:" $dups
+    fail=1
+fi
+for op in mkdir mknod rename; do
+    set x $(grep "^$op " $out.stats)
+    if [ "$3" != 1 ] ; then
+        echo ".fsstats: $op calls '$3' should be 1"
+        fail=1
+    fi
+done
+set x $(grep '^read ' $out.stats)
+if [ "$3" = "" ] || [ "$3" -lt 1 ] ; then
+    echo ".fsstats: no read calls counted"
+    fail=1
+fi
+
+if [ "$fail" ] ; then
+    echo 'Tests may have failed - see above output for details'
+else
+    echo 'Tests passed'
+fi
+rm -f $src $disk $out.stats
+[ "$verbose" ] || rm -f $out
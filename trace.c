@@ -0,0 +1,114 @@
+/*
+ * file:        trace.c
+ * description: block I/O tracing - see trace.h
+ *
+ * Records are buffered by stdio, under a lock, and written out when
+ * the device is flushed or closed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "iostat.h"
+
+#define MAX_COUNT 0xffff
+
+struct trace {
+    struct blkdev *dev;
+    pthread_mutex_t lock;
+    FILE *fp;
+    uint64_t start;
+};
+
+static void record(struct trace *t, int op, int64_t first_blk, int num_blks)
+{
+    struct trace_rec rec = {.ns = io_now() - t->start, .op = op,
+                            .tag = op == TRACE_READ || op == TRACE_WRITE ? io_tag : 0};
+    pthread_mutex_lock(&t->lock);
+    do {
+        rec.blk = first_blk;
+        rec.count = num_blks > MAX_COUNT ? MAX_COUNT : num_blks;
+        fwrite(&rec, sizeof(rec), 1, t->fp);
+        first_blk += rec.count;
+        num_blks -= rec.count;
+    } while (num_blks > 0);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int64_t trace_num_blocks(struct blkdev *tdev)
+{
+    struct trace *t = tdev->private;
+    return t->dev->ops->num_blocks(t->dev);
+}
+
+static int trace_read(struct blkdev *tdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct trace *t = tdev->private;
+    record(t, TRACE_READ, first_blk, num_blks);
+    return t->dev->ops->read(t->dev, first_blk, num_blks, buf);
+}
+
+static int trace_write(struct blkdev *tdev, int64_t first_blk, int num_blks, void *buf)
+{
+    struct trace *t = tdev->private;
+    record(t, TRACE_WRITE, first_blk, num_blks);
+    return t->dev->ops->write(t->dev, first_blk, num_blks, buf);
+}
+
+static int trace_flush(struct blkdev *tdev, int64_t first_blk, int num_blks)
+{
+    struct trace *t = tdev->private;
+    record(t, TRACE_FLUSH, first_blk, num_blks);
+    pthread_mutex_lock(&t->lock);
+    fflush(t->fp);
+    pthread_mutex_unlock(&t->lock);
+    return t->dev->ops->flush(t->dev, first_blk, num_blks);
+}
+
+static int trace_discard(struct blkdev *tdev, int64_t first_blk, int num_blks)
+{
+    struct trace *t = tdev->private;
+    record(t, TRACE_DISCARD, first_blk, num_blks);
+    return t->dev->ops->discard(t->dev, first_blk, num_blks);
+}
+
+static void trace_close(struct blkdev *tdev)
+{
+    struct trace *t = tdev->private;
+    t->dev->ops->close(t->dev);
+    fclose(t->fp);
+    free(t);
+    free(tdev);
+}
+
+struct blkdev_ops trace_ops = {
+    .num_blocks = trace_num_blocks,
+    .read = trace_read,
+    .write = trace_write,
+    .flush = trace_flush,
+    .discard = trace_discard,
+    .close = trace_close
+};
+
+struct blkdev *trace_create(struct blkdev *dev, FILE *fp)
+{
+    struct blkdev *tdev = malloc(sizeof(*tdev));
+    struct trace *t = calloc(1, sizeof(*t));
+
+    if (tdev == NULL || t == NULL)
+        return NULL;
+    t->fp = fp;
+    setvbuf(t->fp, NULL, _IOFBF, 1 << 20);
+
+    struct trace_header hdr = {.magic = TRACE_MAGIC, .nblks = dev->ops->num_blocks(dev)};
+    fwrite(&hdr, sizeof(hdr), 1, t->fp);
+
+    t->dev = dev;
+    pthread_mutex_init(&t->lock, NULL);
+    t->start = io_now();
+    tdev->ops = &trace_ops;
+    tdev->private = t;
+    return tdev;
+}
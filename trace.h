@@ -0,0 +1,41 @@
+/*
+ * file:        trace.h
+ * description: block I/O tracing, as a blkdev wrapper
+ *
+ * Every request through the device is appended to a trace file - when
+ * it started, the operation, the blocks, and the caller's io_tag (see
+ * iostat.h) - and passed through unchanged. replay-img plays a trace
+ * back against another device stack. It's safe to call from several
+ * threads.
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include "blkdev.h"
+
+#define TRACE_MAGIC 0x31525442  /* 'BTR1' */
+
+/* the file is a header followed by records, in the order the requests
+ * were issued (so 'ns' only goes up)
+ */
+struct trace_header {
+    uint32_t magic;
+    uint32_t pad;
+    int64_t nblks;              /* size of the traced device */
+};
+
+enum {TRACE_READ, TRACE_WRITE, TRACE_FLUSH, TRACE_DISCARD};
+
+struct trace_rec {
+    uint64_t ns;                /* since the trace started */
+    uint32_t blk;
+    uint16_t count;             /* longer requests are split */
+    uint8_t op;
+    uint8_t tag;
+};
+
+/* trace to 'fp', an open file, which close will close */
+extern struct blkdev *trace_create(struct blkdev *dev, FILE *fp);
+
+#endif
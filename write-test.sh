@@ -195,6 +195,95 @@ test9(){
   checktest 9
 }
 
+blockstest(){
+    val=$(stat -c %b $MNT/$1)
+    if [ "$val" != "$2" ] ; then
+	echo blocks $MNT/$1: $val
+	echo should be $2
+	fail=1
+    fi
+}
+
+test10(){
+  # sparse files
+  echo Test 10 - holes
+  echo hello | dd of=$MNT/sparse.dat bs=1024 seek=300 > /dev/null 2> /dev/null || fail=1
+  cksumtest sparse.dat "$( (head -c 307200 /dev/zero; echo hello) | cksum)"
+  # data block plus two indirect blocks, in 512-byte units
+  blockstest sparse.dat 6
+  echo hello | dd of=$MNT/sparse.dat bs=1 seek=10 conv=notrunc > /dev/null 2> /dev/null || fail=1
+  blockstest sparse.dat 8
+  # zeros written into a hole stay a hole
+  head -c 8192 /dev/zero > $MNT/zeros.dat
+  cksumtest zeros.dat "$(head -c 8192 /dev/zero | cksum)"
+  blockstest zeros.dat 0
+  rm -f $MNT/sparse.dat $MNT/zeros.dat
+  checktest 10
+}
+
+test11(){
+  # truncate to arbitrary lengths
+  echo Test 11 - truncate to length
+  yes test 11 data file | head -c 307200 > $TMP
+  cp $TMP $MNT/test-11.dat
+  truncate -s 5000 $MNT/test-11.dat || fail=1
+  cksumtest test-11.dat "$(head -c 5000 $TMP | cksum)"
+  blockstest test-11.dat 10
+  # extend - the old tail must read back as zeros
+  truncate -s 20000 $MNT/test-11.dat || fail=1
+  cksumtest test-11.dat "$( (head -c 5000 $TMP; head -c 15000 /dev/zero) | cksum)"
+  blockstest test-11.dat 10
+  truncate -s 0 $MNT/test-11.dat || fail=1
+  blockstest test-11.dat 0
+  rm -f $TMP $MNT/test-11.dat
+  checktest 11
+}
+
+test12(){
+  # fallocate - preallocate, keep-size and punch-hole modes
+  echo Test 12 - fallocate
+  fallocate -l 65536 $MNT/test-12.dat || fail=1
+  cksumtest test-12.dat "$(head -c 65536 /dev/zero | cksum)"
+  # 64 data blocks plus indir_1, in 512-byte units
+  blockstest test-12.dat 130
+  yes test 12 data file | head -c 65536 > $TMP
+  dd if=$TMP of=$MNT/test-12.dat bs=4096 conv=notrunc > /dev/null 2> /dev/null || fail=1
+  cksumtest test-12.dat "$(cat $TMP | cksum)"
+  fallocate -p -o 1000 -l 10000 $MNT/test-12.dat || fail=1
+  cksumtest test-12.dat "$( (head -c 1000 $TMP; head -c 10000 /dev/zero; tail -c +11001 $TMP) | cksum)"
+  # blocks 1-9 freed
+  blockstest test-12.dat 112
+  fallocate -n -o 65536 -l 8192 $MNT/test-12.dat || fail=1
+  cksumtest test-12.dat "$( (head -c 1000 $TMP; head -c 10000 /dev/zero; tail -c +11001 $TMP) | cksum)"
+  blockstest test-12.dat 128
+  rm -f $TMP $MNT/test-12.dat
+  checktest 12
+}
+
+statfstest(){
+    val=$(stat -f -c '%f %d' $MNT)
+    if [ "$val" != "$1" ] ; then
+	echo "free blocks/inodes: '$val' should be '$1'"
+	fail=1
+    fi
+}
+
+test13(){
+  # statfs - free block and inode counts follow allocation
+  echo Test 13 - statfs free counts
+  # files removed while still open are only deleted on their last
+  # release, which may not have arrived yet
+  while ls -a $MNT | grep -q fuse_hidden ; do sleep 0.1 ; done
+  set x $(stat -f -c '%f %d' $MNT)
+  bfree=$2 ffree=$3
+  yes test 13 data file | head -c 6144 > $MNT/test-13.dat
+  # 6 direct blocks and an inode
+  statfstest "$((bfree - 6)) $((ffree - 1))"
+  rm -f $MNT/test-13.dat
+  statfstest "$bfree $ffree"
+  checktest 13
+}
+
 if [ "x$test_n" != "x" ]; then
   eval "test$test_n"
 else
@@ -207,6 +296,10 @@ else
   test7
   test8
   test9
+  test10
+  test11
+  test12
+  test13
 fi
 
 if [ "$failedtests" = "" ] ; then